@@ -0,0 +1,353 @@
+#pragma once
+
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <exception>
+#include <algorithm>
+#include <new>
+#include <utility>
+#include <chrono>
+#include <cassert>
+#include "NodePool.h"
+#include "ThreadPool.h"
+
+/*
+ * Actor 运行时
+ *   class account : public actor<long> { void receive(long &amount) override { balance += amount; } long balance = 0; };
+ *   std::shared_ptr<account> a = spawn<account>();
+ *   a->send(100);
+ * 1. 每个 actor 有一个无锁的多生产者单消费者邮箱（Dmitry Vyukov 的非侵入式 MPSC 队列），
+ *    send 只做一次 exchange 和一次 store，节点从 node_pool 分配，生产者分配、消费者释放
+ * 2. pending 记录 send 的次数，从 0 变成 1 的那次 send 把 actor 投递到线程池，
+ *    所以任何时刻一个 actor 最多在一个线程上运行，receive 中访问 actor 自己的状态不需要加锁
+ * 3. 每次运行最多处理 quantum 条消息，还有消息时重新排到线程池队尾，消息多的 actor 不会饿死别的 actor
+ * 4. 邮箱为空的 actor 不占线程也不在线程池队列中，只占自身和一个哨兵节点的内存，可以有大量空闲的 actor
+ * actor 必须由 shared_ptr 管理（用 spawn 创建），运行时持有它的引用；线程池停止后在 send 的线程上处理消息
+ */
+template <typename Message>
+class actor : public std::enable_shared_from_this<actor<Message>>
+{
+public:
+    actor(actor const &) = delete;
+    actor &operator=(actor const &) = delete;
+
+    virtual ~actor()
+    {
+        // 剩下的消息没有处理，只析构
+        mailbox_node *node = tail;
+        mailbox_node *next = node->next.load(std::memory_order_acquire);
+        delete node;
+        while (next != nullptr)
+        {
+            node = next;
+            next = node->next.load(std::memory_order_acquire);
+            node->value()->~Message();
+            delete node;
+        }
+    }
+
+    void send(Message message)
+    {
+        emplace(std::move(message));
+    }
+
+    template <typename... Args>
+    void emplace(Args &&...args)
+    {
+        mailbox_node *node = new mailbox_node;
+        ::new (node->storage) Message(std::forward<Args>(args)...);
+        // 先计数再链入，消费者能取到的节点一定已经计过数，fetch_sub 不会减到 0 以下；
+        // 否则消费者可能取走还没计数的消息，计数先减到"负数"再被这次 fetch_add 加回 0，漏掉调度，
+        // 下一次 send 又从 0 开始调度，同一个 actor 会在两个线程上同时运行
+        bool const first = pending.fetch_add(1, std::memory_order_acq_rel) == 0;
+        mailbox_node *prev = head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+        if (first)
+        {
+            schedule();
+        }
+    }
+
+    // 邮箱中消息个数的近似值
+    std::size_t mailbox_size() const
+    {
+        return pending.load(std::memory_order_relaxed);
+    }
+
+protected:
+    // 创建时取一次线程池：调度发生在线程池的线程上，在那里调用 getInstance 会临时持有线程池的 shared_ptr，
+    // 进程退出时如果它成了最后一个引用，线程池会在自己的线程上析构并 join 自己
+    explicit actor(std::size_t quantum_ = 64)
+        : quantum(std::max<std::size_t>(1, quantum_)), pool(ThreadPool::getInstance().get())
+    {
+        mailbox_node *stub = new mailbox_node;
+        head.store(stub, std::memory_order_relaxed);
+        tail = stub;
+    }
+
+    // 只在 actor 自己的运行中调用，同一个 actor 的两次调用之间有 happens-before 关系
+    virtual void receive(Message &message) = 0;
+
+    // receive 抛出异常时调用，这条消息被丢弃，之后的消息照常处理
+    virtual void on_exception(std::exception_ptr) {}
+
+private:
+    struct mailbox_node
+    {
+        std::atomic<mailbox_node *> next{nullptr};
+        alignas(Message) unsigned char storage[sizeof(Message)];
+
+        Message *value()
+        {
+            return std::launder(reinterpret_cast<Message *>(storage));
+        }
+
+        static void *operator new(std::size_t)
+        {
+            return node_pool<mailbox_node>::allocate();
+        }
+
+        static void operator delete(void *ptr)
+        {
+            node_pool<mailbox_node>::deallocate(ptr);
+        }
+    };
+
+    void schedule()
+    {
+        std::shared_ptr<actor> self = this->shared_from_this();
+        std::future<void> fut = pool->commit([self]()
+                                                                  {
+            if (self->run_batch())
+            {
+                self->schedule();
+            } });
+        if (!fut.valid())
+        {
+            while (run_batch())
+            {
+            }
+        }
+    }
+
+    /*
+     * 处理一批消息，返回 true 表示还有消息，需要再次调度
+     * 计数先于链入，计过数的消息可能还没链好（生产者已经计数但还没有交换 head 或链上 prev->next）：
+     * 这一批到此为止，只减去实际取出的个数，剩下的留到重新调度之后，不在线程池的线程上自旋等待
+     */
+    bool run_batch()
+    {
+        std::size_t n = 0;
+        while (n < quantum)
+        {
+            // 旧的哨兵释放，取出消息的节点成为新的哨兵
+            mailbox_node *next = tail->next.load(std::memory_order_acquire);
+            if (next == nullptr)
+            {
+                break;
+            }
+            ++n;
+            delete tail;
+            tail = next;
+            Message *message = next->value();
+            try
+            {
+                receive(*message);
+            }
+            catch (...)
+            {
+                on_exception(std::current_exception());
+            }
+            message->~Message();
+        }
+        if (n == 0)
+        {
+            // 计数已经增加但节点还没链好，生产者马上就会链上，让出线程给它
+            std::this_thread::yield();
+            return true;
+        }
+        return pending.fetch_sub(n, std::memory_order_acq_rel) != n;
+    }
+
+    std::size_t const quantum;
+    ThreadPool *const pool;
+    // 生产者一侧，最后一个放入的节点
+    alignas(64) std::atomic<mailbox_node *> head;
+    // 消费者一侧，哨兵节点，只在 actor 运行时访问
+    alignas(64) mailbox_node *tail;
+    std::atomic<std::size_t> pending{0};
+};
+
+template <typename A, typename... Args>
+std::shared_ptr<A> spawn(Args &&...args)
+{
+    return std::make_shared<A>(std::forward<Args>(args)...);
+}
+
+// 用一个函数对象作为 receive 的 actor，函数对象本身就是 actor 的状态
+template <typename Message, typename Handler>
+class function_actor : public actor<Message>
+{
+public:
+    explicit function_actor(Handler handler_, std::size_t quantum = 64)
+        : actor<Message>(quantum), handler(std::move(handler_))
+    {
+    }
+
+protected:
+    void receive(Message &message) override
+    {
+        handler(message);
+    }
+
+private:
+    Handler handler;
+};
+
+template <typename Message, typename Handler>
+std::shared_ptr<actor<Message>> spawn_function(Handler handler, std::size_t quantum = 64)
+{
+    return std::make_shared<function_actor<Message, Handler>>(std::move(handler), quantum);
+}
+
+/* 测试：多个线程向同一个账户 actor 存款，状态不加锁；十万个 actor 排成一圈传递令牌 */
+namespace actor_test
+{
+    struct account_message
+    {
+        long amount = 0;
+        std::promise<long> *reply = nullptr; // 不为空时查询余额
+    };
+
+    class account : public actor<account_message>
+    {
+    public:
+        account() : actor<account_message>(32) {}
+
+    protected:
+        void receive(account_message &message) override
+        {
+            if (message.reply != nullptr)
+            {
+                message.reply->set_value(balance);
+                return;
+            }
+            balance += message.amount;
+        }
+
+    private:
+        long balance = 0;
+    };
+
+    // 检查 receive 不会在两个线程上同时运行，邮箱计数不会超过已发送的消息数
+    class checker : public actor<int>
+    {
+    public:
+        checker(long total_, std::promise<long> &done_) : actor<int>(8), total(total_), done(done_) {}
+
+        std::atomic<long> overlaps{0};
+        std::atomic<long> overcounts{0};
+
+    protected:
+        void receive(int &) override
+        {
+            if (running.exchange(true, std::memory_order_acq_rel))
+            {
+                overlaps++;
+            }
+            if (mailbox_size() > static_cast<std::size_t>(total))
+            {
+                overcounts++;
+            }
+            // 不加锁的状态，只有单消费者时才正确
+            if (++received == total)
+            {
+                done.set_value(received);
+            }
+            running.store(false, std::memory_order_release);
+        }
+
+    private:
+        long const total;
+        std::promise<long> &done;
+        long received = 0;
+        std::atomic<bool> running{false};
+    };
+}
+
+void TestActor()
+{
+    std::shared_ptr<actor_test::account> bank = spawn<actor_test::account>();
+    std::vector<std::thread> clients;
+    for (int t = 0; t < 4; t++)
+    {
+        clients.emplace_back([&bank]()
+                             {
+            for (long i = 1; i <= 10000; i++)
+            {
+                bank->send(actor_test::account_message{i, nullptr});
+            } });
+    }
+    for (auto &th : clients)
+    {
+        th.join();
+    }
+    std::promise<long> balance;
+    bank->send(actor_test::account_message{0, &balance});
+    std::cout << "balance is " << balance.get_future().get() << ", expected " << 4 * 10000L * 10001 / 2 << std::endl;
+
+    // 多个生产者并发 send，生产者不时让出线程，让消费者在生产者计数和链入之间运行
+    {
+        int const producers = 4;
+        int const per_producer = 50000;
+        std::promise<long> done;
+        std::shared_ptr<actor_test::checker> check = spawn<actor_test::checker>(long(producers) * per_producer, done);
+        std::vector<std::thread> senders;
+        for (int t = 0; t < producers; t++)
+        {
+            senders.emplace_back([&check]()
+                                 {
+                for (int i = 0; i < per_producer; i++)
+                {
+                    check->send(i);
+                    if (i % 64 == 0)
+                    {
+                        std::this_thread::yield();
+                    }
+                } });
+        }
+        for (auto &th : senders)
+        {
+            th.join();
+        }
+        long const received = done.get_future().get();
+        std::cout << "checker received " << received << ", concurrent receive " << check->overlaps
+                  << ", mailbox over count " << check->overcounts << std::endl;
+        assert(received == long(producers) * per_producer);
+        assert(check->overlaps == 0);
+        assert(check->overcounts == 0);
+    }
+
+    // 每个 actor 收到令牌后转给下一个，令牌转满一圈后通知主线程
+    int const ring_size = 100000;
+    std::vector<std::shared_ptr<actor<int>>> ring(ring_size);
+    std::promise<int> done;
+    ring[ring_size - 1] = spawn_function<int>([&done](int &hops)
+                                              { done.set_value(hops + 1); });
+    for (int i = ring_size - 2; i >= 0; i--)
+    {
+        actor<int> *next = ring[i + 1].get();
+        ring[i] = spawn_function<int>([next](int &hops)
+                                      { next->send(hops + 1); });
+    }
+    auto const begin = std::chrono::steady_clock::now();
+    ring[0]->send(0);
+    int const hops = done.get_future().get();
+    auto const elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin);
+    std::cout << "token passed through " << hops << " actors in " << elapsed.count() << "ms" << std::endl;
+}
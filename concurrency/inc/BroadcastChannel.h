@@ -0,0 +1,364 @@
+#pragma once
+
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <chrono>
+
+/*
+ * 广播通道（一写多读）
+ * 一个生产者喂多个互相独立的消费者时，给每个消费者一个 Channel，每条消息要拷贝 N 次、占 N 份内存。
+ * 广播通道只有一个环形缓冲区，每条消息只写一次，以 shared_ptr<const T> 保存，订阅者各自维护一个读游标，
+ * 读到的是同一个对象的共享引用，内存和拷贝开销都与订阅者个数无关。
+ * 环形缓冲区写满（最慢的订阅者还没读走最老的消息）时的处理方式由 broadcast_policy 决定：
+ * 1. block：生产者阻塞，直到最慢的订阅者读走一条，所有订阅者都不会丢消息
+ * 2. drop_newest：丢弃新消息，send 返回 false，已经在缓冲区里的消息不受影响
+ * 3. lag：覆盖最老的消息，落后超过一圈的订阅者跳到仍然可读的最老消息，并记录跳过了几条（missed）
+ * 新订阅者从订阅之后的第一条消息开始读；close 之后订阅者读完剩下的消息，receive 再返回空
+ */
+enum class broadcast_policy
+{
+    block,
+    drop_newest,
+    lag
+};
+
+template <typename T>
+class broadcast_subscriber;
+
+template <typename T>
+class broadcast_channel
+{
+    friend class broadcast_subscriber<T>;
+
+    struct cursor_type
+    {
+        std::uint64_t next;        // 下一条要读的消息序号
+        std::uint64_t missed = 0;  // lag 策略下被覆盖、没读到的消息个数
+    };
+
+    // 订阅者持有 state 的 shared_ptr，通道先于订阅者析构也是安全的
+    struct state
+    {
+        std::mutex mutex;
+        std::condition_variable readable;
+        std::condition_variable writable;
+        std::vector<std::shared_ptr<T const>> ring;
+        std::list<cursor_type> cursors;
+        std::uint64_t tail = 0; // 下一条消息的序号
+        std::uint64_t dropped = 0;
+        unsigned blocked_senders = 0;
+        broadcast_policy policy;
+        bool closed = false;
+
+        std::uint64_t capacity() const
+        {
+            return ring.size();
+        }
+
+        // 最慢的订阅者的游标，调用方持有 mutex
+        std::uint64_t slowest() const
+        {
+            std::uint64_t result = tail;
+            for (cursor_type const &cursor : cursors)
+            {
+                result = std::min(result, cursor.next);
+            }
+            return result;
+        }
+
+        bool full() const
+        {
+            return !cursors.empty() && tail - slowest() >= capacity();
+        }
+    };
+
+public:
+    explicit broadcast_channel(std::size_t capacity, broadcast_policy policy = broadcast_policy::block)
+        : shared(std::make_shared<state>())
+    {
+        shared->ring.resize(std::max<std::size_t>(1, capacity));
+        shared->policy = policy;
+    }
+
+    broadcast_channel(broadcast_channel const &) = delete;
+    broadcast_channel &operator=(broadcast_channel const &) = delete;
+
+    ~broadcast_channel()
+    {
+        close();
+    }
+
+    // 返回 false 表示通道已关闭，或者 drop_newest 策略下消息被丢弃
+    bool send(T value)
+    {
+        return publish(std::make_shared<T const>(std::move(value)));
+    }
+
+    template <typename... Args>
+    bool emplace(Args &&...args)
+    {
+        return publish(std::make_shared<T const>(std::forward<Args>(args)...));
+    }
+
+    broadcast_subscriber<T> subscribe()
+    {
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        shared->cursors.push_back(cursor_type{shared->tail});
+        return broadcast_subscriber<T>(shared, std::prev(shared->cursors.end()));
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        shared->closed = true;
+        shared->readable.notify_all();
+        shared->writable.notify_all();
+    }
+
+    // drop_newest 策略下丢弃的消息个数
+    std::uint64_t dropped() const
+    {
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        return shared->dropped;
+    }
+
+    std::size_t subscribers() const
+    {
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        return shared->cursors.size();
+    }
+
+    std::size_t capacity() const
+    {
+        return shared->ring.size();
+    }
+
+private:
+    bool publish(std::shared_ptr<T const> message)
+    {
+        std::unique_lock<std::mutex> lock(shared->mutex);
+        if (shared->policy == broadcast_policy::block && !shared->closed && shared->full())
+        {
+            ++shared->blocked_senders;
+            shared->writable.wait(lock, [this]()
+                                  { return shared->closed || !shared->full(); });
+            --shared->blocked_senders;
+        }
+        if (shared->closed)
+        {
+            return false;
+        }
+        if (shared->policy == broadcast_policy::drop_newest && shared->full())
+        {
+            ++shared->dropped;
+            return false;
+        }
+        // 被覆盖的旧消息在锁外释放，订阅者可能还持有它的引用
+        message.swap(shared->ring[shared->tail % shared->capacity()]);
+        ++shared->tail;
+        lock.unlock();
+        shared->readable.notify_all();
+        return true;
+    }
+
+    std::shared_ptr<state> shared;
+};
+
+/* 订阅者，析构时退订；只能被一个线程使用，多个线程读同一个通道应该各自订阅 */
+template <typename T>
+class broadcast_subscriber
+{
+    using state = typename broadcast_channel<T>::state;
+    using cursor_iterator = typename std::list<typename broadcast_channel<T>::cursor_type>::iterator;
+
+public:
+    broadcast_subscriber(broadcast_subscriber &&other) noexcept
+        : shared(std::move(other.shared)), cursor(other.cursor)
+    {
+    }
+
+    broadcast_subscriber &operator=(broadcast_subscriber &&other) noexcept
+    {
+        if (this != &other)
+        {
+            unsubscribe();
+            shared = std::move(other.shared);
+            cursor = other.cursor;
+        }
+        return *this;
+    }
+
+    ~broadcast_subscriber()
+    {
+        unsubscribe();
+    }
+
+    // 阻塞读下一条消息，通道关闭并且读完之后返回空指针
+    std::shared_ptr<T const> receive()
+    {
+        std::unique_lock<std::mutex> lock(shared->mutex);
+        shared->readable.wait(lock, [this]()
+                              { return shared->closed || cursor->next != shared->tail; });
+        return take(lock);
+    }
+
+    bool receive(T &value)
+    {
+        std::shared_ptr<T const> message = receive();
+        if (!message)
+        {
+            return false;
+        }
+        value = *message;
+        return true;
+    }
+
+    // 没有新消息时立即返回空指针
+    std::shared_ptr<T const> try_receive()
+    {
+        std::unique_lock<std::mutex> lock(shared->mutex);
+        return take(lock);
+    }
+
+    // lag 策略下因为读得太慢被跳过的消息个数
+    std::uint64_t missed() const
+    {
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        return cursor->missed;
+    }
+
+    // 还没读的消息个数
+    std::size_t pending() const
+    {
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        return static_cast<std::size_t>(std::min(shared->tail - cursor->next, shared->capacity()));
+    }
+
+private:
+    friend class broadcast_channel<T>;
+
+    broadcast_subscriber(std::shared_ptr<state> shared_, cursor_iterator cursor_)
+        : shared(std::move(shared_)), cursor(cursor_)
+    {
+    }
+
+    std::shared_ptr<T const> take(std::unique_lock<std::mutex> &lock)
+    {
+        if (cursor->next == shared->tail)
+        {
+            return std::shared_ptr<T const>();
+        }
+        // 落后超过一圈，最老的消息已经被覆盖，只有 lag 策略会出现
+        std::uint64_t const oldest = shared->tail > shared->capacity() ? shared->tail - shared->capacity() : 0;
+        if (cursor->next < oldest)
+        {
+            cursor->missed += oldest - cursor->next;
+            cursor->next = oldest;
+        }
+        bool const was_slowest = shared->blocked_senders != 0 && shared->tail - cursor->next == shared->capacity();
+        std::shared_ptr<T const> message = shared->ring[cursor->next % shared->capacity()];
+        ++cursor->next;
+        lock.unlock();
+        // 只有最慢的订阅者前进才可能腾出位置
+        if (was_slowest)
+        {
+            shared->writable.notify_all();
+        }
+        return message;
+    }
+
+    void unsubscribe()
+    {
+        if (!shared)
+        {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(shared->mutex);
+            shared->cursors.erase(cursor);
+            shared->writable.notify_all();
+        }
+        shared.reset();
+    }
+
+    std::shared_ptr<state> shared;
+    cursor_iterator cursor;
+};
+
+/* 测试：block 策略下每个订阅者都读到全部消息；lag 策略下慢订阅者读到的加上跳过的等于总数 */
+void TestBroadcastChannel()
+{
+    int const total = 20000;
+    {
+        broadcast_channel<long> channel(64);
+        std::vector<broadcast_subscriber<long>> subscribers;
+        for (int i = 0; i < 4; i++)
+        {
+            subscribers.push_back(channel.subscribe());
+        }
+        std::vector<long> sums(subscribers.size(), 0);
+        std::vector<std::thread> readers;
+        for (std::size_t i = 0; i < subscribers.size(); i++)
+        {
+            readers.emplace_back([&, i]()
+                                 {
+                long value = 0;
+                while (subscribers[i].receive(value))
+                {
+                    sums[i] += value;
+                } });
+        }
+        for (long i = 1; i <= total; i++)
+        {
+            channel.send(i);
+        }
+        channel.close();
+        for (auto &th : readers)
+        {
+            th.join();
+        }
+        for (std::size_t i = 0; i < sums.size(); i++)
+        {
+            std::cout << "block subscriber " << i << " sum is " << sums[i]
+                      << ", expected " << static_cast<long>(total) * (total + 1) / 2 << std::endl;
+        }
+    }
+    {
+        broadcast_channel<long> channel(64, broadcast_policy::lag);
+        broadcast_subscriber<long> fast = channel.subscribe();
+        broadcast_subscriber<long> slow = channel.subscribe();
+        long fast_count = 0;
+        long slow_count = 0;
+        std::thread fast_reader([&]()
+                                {
+            while (fast.receive())
+            {
+                fast_count++;
+            } });
+        std::thread slow_reader([&]()
+                                {
+            while (slow.receive())
+            {
+                slow_count++;
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            } });
+        for (long i = 1; i <= total; i++)
+        {
+            channel.send(i);
+        }
+        channel.close();
+        fast_reader.join();
+        slow_reader.join();
+        std::cout << "lag fast received " << fast_count << " missed " << fast.missed()
+                  << ", slow received " << slow_count << " missed " << slow.missed()
+                  << ", total " << total << std::endl;
+    }
+}
@@ -1,66 +1,1230 @@
+#pragma once
+
 #include <iostream>
-#include <queue>
+#include <thread>
+#include <deque>
+#include <vector>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <iterator>
+#include <string>
+
+// C++20 协程可用时提供 co_await 版本的 send/receive
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#include <optional>
+#include "ThreadPool.h"
+#define CSP_HAS_COROUTINES 1
+#endif
+#endif
 
+/*
+ * 有界多生产者多消费者环形缓冲（Dmitry Vyukov 的有界队列）
+ * 每个格子带一个序号，生产者和消费者各自用 CAS 推进自己的位置，格子的序号告诉对方这个格子是否可用，全程不加锁。
+ * 关闭标志放在入队位置的最高位：关闭之后没有生产者能再占到格子，消费者看到入队位置停在自己这里就知道已经取完
+ */
+template <typename T>
+class mpmc_ring
+{
+public:
+    enum result
+    {
+        ok,
+        full,  // try_push: 没有空位
+        empty, // try_pop: 没有数据
+        closed
+    };
+
+    // 算法要求至少两个格子，容量为 1 时按 2 处理
+    explicit mpmc_ring(std::size_t capacity)
+        : size(std::max<std::size_t>(capacity, 2)), cells(new cell[size])
+    {
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // 析构时不应该再有并发访问，占到格子的生产者都已写完
+    ~mpmc_ring()
+    {
+        std::size_t const tail = enqueue_pos.value.load(std::memory_order_relaxed) & ~closed_bit;
+        for (std::size_t pos = dequeue_pos.value.load(std::memory_order_relaxed); pos != tail; ++pos)
+        {
+            std::launder(reinterpret_cast<T *>(cells[pos % size].storage))->~T();
+        }
+    }
+
+    mpmc_ring(mpmc_ring const &) = delete;
+    mpmc_ring &operator=(mpmc_ring const &) = delete;
+
+    template <typename U>
+    result try_push(U &&value)
+    {
+        return try_emplace(std::forward<U>(value));
+    }
+
+    // 只有占到格子之后才用 args 构造元素，返回 full 或 closed 时 args 没有被使用
+    template <typename... Args>
+    result try_emplace(Args &&...args)
+    {
+        cell *c = nullptr;
+        std::size_t pos = enqueue_pos.value.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            if (pos & closed_bit)
+            {
+                return closed;
+            }
+            c = &cells[pos % size];
+            std::size_t const seq = c->seq.load(std::memory_order_acquire);
+            std::intptr_t const diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+            if (diff == 0)
+            {
+                if (enqueue_pos.value.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                // 格子还没被上一轮的消费者取走
+                return full;
+            }
+            else
+            {
+                pos = enqueue_pos.value.load(std::memory_order_relaxed);
+            }
+        }
+        new (c->storage) T(std::forward<Args>(args)...);
+        c->seq.store(pos + 1, std::memory_order_release);
+        return ok;
+    }
+
+    result try_pop(T &value)
+    {
+        cell *c = nullptr;
+        std::size_t pos = dequeue_pos.value.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            c = &cells[pos % size];
+            std::size_t const seq = c->seq.load(std::memory_order_acquire);
+            std::intptr_t const diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1);
+            if (diff == 0)
+            {
+                if (dequeue_pos.value.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                // 格子为空：已关闭且所有占到格子的生产者都已写完才算取完，否则只是暂时没有数据
+                std::size_t const tail = enqueue_pos.value.load(std::memory_order_acquire);
+                return (tail & closed_bit) && (tail & ~closed_bit) == pos ? closed : empty;
+            }
+            else
+            {
+                pos = dequeue_pos.value.load(std::memory_order_relaxed);
+            }
+        }
+        T *item = std::launder(reinterpret_cast<T *>(c->storage));
+        value = std::move(*item);
+        item->~T();
+        c->seq.store(pos + size, std::memory_order_release);
+        return ok;
+    }
+
+    /*
+     * 批量放入：一次 CAS 占下从入队位置开始的连续空格子，最多 count 个，再依次构造并发布。
+     * 格子只能由占到它的生产者填满，所以检查时空闲的格子在 CAS 成功之前不会被占用。
+     * 放入的元素从 first 开始依次取，first 前进放入的个数；一个都放不进时 status 为 full 或 closed
+     */
+    template <typename ForwardIt>
+    std::size_t try_push_batch(ForwardIt &first, std::size_t count, result &status)
+    {
+        std::size_t pos = enqueue_pos.value.load(std::memory_order_relaxed);
+        std::size_t claimed = 0;
+        for (;;)
+        {
+            if (pos & closed_bit)
+            {
+                status = closed;
+                return 0;
+            }
+            claimed = 0;
+            while (claimed < count && claimed < size &&
+                   cells[(pos + claimed) % size].seq.load(std::memory_order_acquire) == pos + claimed)
+            {
+                ++claimed;
+            }
+            if (claimed == 0)
+            {
+                std::size_t const seq = cells[pos % size].seq.load(std::memory_order_acquire);
+                if (static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos) < 0)
+                {
+                    status = full;
+                    return 0;
+                }
+                pos = enqueue_pos.value.load(std::memory_order_relaxed);
+                continue;
+            }
+            if (enqueue_pos.value.compare_exchange_weak(pos, pos + claimed, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        for (std::size_t i = 0; i < claimed; ++i, ++first)
+        {
+            cell &c = cells[(pos + i) % size];
+            new (c.storage) T(*first);
+            c.seq.store(pos + i + 1, std::memory_order_release);
+        }
+        status = ok;
+        return claimed;
+    }
+
+    // 批量取出：一次 CAS 取走从出队位置开始的连续已发布格子，最多 count 个，依次写入 out
+    template <typename OutputIt>
+    std::size_t try_pop_batch(OutputIt &out, std::size_t count, result &status)
+    {
+        std::size_t pos = dequeue_pos.value.load(std::memory_order_relaxed);
+        std::size_t claimed = 0;
+        for (;;)
+        {
+            claimed = 0;
+            while (claimed < count && claimed < size &&
+                   cells[(pos + claimed) % size].seq.load(std::memory_order_acquire) == pos + claimed + 1)
+            {
+                ++claimed;
+            }
+            if (claimed == 0)
+            {
+                std::size_t const seq = cells[pos % size].seq.load(std::memory_order_acquire);
+                if (static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1) < 0)
+                {
+                    std::size_t const tail = enqueue_pos.value.load(std::memory_order_acquire);
+                    status = (tail & closed_bit) && (tail & ~closed_bit) == pos ? closed : empty;
+                    return 0;
+                }
+                pos = dequeue_pos.value.load(std::memory_order_relaxed);
+                continue;
+            }
+            if (dequeue_pos.value.compare_exchange_weak(pos, pos + claimed, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        for (std::size_t i = 0; i < claimed; ++i)
+        {
+            cell &c = cells[(pos + i) % size];
+            T *item = std::launder(reinterpret_cast<T *>(c.storage));
+            *out = std::move(*item);
+            ++out;
+            item->~T();
+            c.seq.store(pos + i + size, std::memory_order_release);
+        }
+        status = ok;
+        return claimed;
+    }
+
+    void close()
+    {
+        enqueue_pos.value.fetch_or(closed_bit, std::memory_order_acq_rel);
+    }
+
+    bool is_closed() const
+    {
+        return (enqueue_pos.value.load(std::memory_order_acquire) & closed_bit) != 0;
+    }
+
+    std::size_t capacity() const
+    {
+        return size;
+    }
+
+    // 当前元素个数的近似值，包括已占位但还没写完的格子
+    std::size_t approximate_size() const
+    {
+        std::size_t const tail = enqueue_pos.value.load(std::memory_order_relaxed) & ~closed_bit;
+        std::size_t const head = dequeue_pos.value.load(std::memory_order_relaxed);
+        return tail > head ? std::min(tail - head, size) : 0;
+    }
+
+private:
+    static constexpr std::size_t closed_bit = std::size_t(1) << (sizeof(std::size_t) * 8 - 1);
+
+    struct cell
+    {
+        std::atomic<std::size_t> seq;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    // 入队和出队位置分别占一个缓存行，生产者和消费者互不干扰
+    struct alignas(64) position
+    {
+        std::atomic<std::size_t> value{0};
+    };
+
+    std::size_t const size;
+    std::unique_ptr<cell[]> cells;
+    position enqueue_pos;
+    position dequeue_pos;
+};
+
+/*
+ * 挂起的线程
+ * 线程在一次 select 中可能同时登记在多个通道上，只能被其中一个分支唤醒：唤醒方在 parker 的锁内
+ * 检查 fired，第一个成功的唤醒方才能交接数据并记下分支下标，之后的唤醒方都会失败。
+ * 所有者登记之后还要再轮询一遍所有分支，轮询期间置 claimed，此时的唤醒失败并记下 missed，
+ * 所有者轮询完发现 missed 就再轮询一遍，不会丢失唤醒。
+ * 协程没有线程可以挂起，设置 notify 之后唤醒方不再通知条件变量，而是调用 notify(context)
+ */
+class channel_parker
+{
+public:
+    enum fire_result
+    {
+        fire_ok,   // 唤醒成功
+        fire_done, // 已经被别的分支唤醒或已超时，等待者应该从通道中摘掉
+        fire_busy  // 所有者正在轮询，等待者留在通道中
+    };
+
+    // 唤醒成功前在锁内执行 action，用于无缓冲通道交接数据
+    template <typename Action>
+    fire_result try_fire(int index, Action &&action)
+    {
+        std::lock_guard<std::mutex> lock(m);
+        if (fired != -1)
+        {
+            return fire_done;
+        }
+        if (claimed)
+        {
+            missed = true;
+            return fire_busy;
+        }
+        action();
+        fired = index;
+        if (notify != nullptr)
+        {
+            notify(context);
+        }
+        else
+        {
+            cv.notify_one();
+        }
+        return fire_ok;
+    }
+
+    // notify 在唤醒方持有通道锁和 parker 锁时调用，只能投递恢复任务，不能就地恢复等待者
+    void set_notify(void (*notify_)(void *), void *context_)
+    {
+        notify = notify_;
+        context = context_;
+    }
+
+    // 开始登记和轮询
+    void begin_poll()
+    {
+        std::lock_guard<std::mutex> lock(m);
+        fired = -1;
+        claimed = true;
+        missed = false;
+    }
+
+    // 轮询结束，轮询期间有人试图唤醒时返回 false，需要再轮询一遍
+    bool end_poll()
+    {
+        std::lock_guard<std::mutex> lock(m);
+        if (missed)
+        {
+            missed = false;
+            return false;
+        }
+        claimed = false;
+        return true;
+    }
+
+    // 等待被唤醒，返回分支下标；到达 deadline 仍未被唤醒时返回 timeout_index，之后的唤醒都会失败
+    int wait(std::chrono::steady_clock::time_point const *deadline, int timeout_index)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        auto ready = [this]()
+        { return fired != -1; };
+        if (deadline == nullptr)
+        {
+            cv.wait(lock, ready);
+        }
+        else if (!cv.wait_until(lock, *deadline, ready))
+        {
+            fired = timeout_index;
+        }
+        return fired;
+    }
+
+private:
+    std::mutex m;
+    std::condition_variable cv;
+    int fired = -1;
+    bool claimed = false;
+    bool missed = false;
+    void (*notify)(void *) = nullptr;
+    void *context = nullptr;
+};
+
+/* select 的一个分支，send/receive 本身也按只有一个分支的 select 执行 */
+class select_case_base
+{
+public:
+    virtual ~select_case_base() {}
+
+    // 不阻塞地尝试一次。就绪时返回 true，ok 表示操作是否成功，通道已关闭时为 false。
+    // self 是正在轮询的 parker，无缓冲通道不会和自己配对
+    virtual bool poll(channel_parker *self, bool &ok) = 0;
+    // 登记到通道的等待队列
+    virtual void enlist(channel_parker *parker, int index) = 0;
+    virtual void delist() = 0;
+    // 被唤醒之后：无缓冲通道的交接已经由对方完成（或者通道被关闭），返回 true；
+    // 有缓冲通道只是被告知可以再试一次，返回 false
+    virtual bool completed(bool &ok) = 0;
+    // 有缓冲通道的唤醒没有用在本分支上时，转给该通道上同方向的下一个等待者
+    virtual void forward_wake() = 0;
+
+    std::function<void(bool)> handler;
+};
+
+enum
+{
+    select_default = -1, // 没有分支就绪，执行了 default 分支
+    select_timeout = -2  // 超时
+};
+
+// 带截止时间的 receive 的结果
+enum class channel_status
+{
+    ok,
+    closed, // 通道已关闭且取完
+    timeout
+};
+
+/*
+ * 在多个分支上等待，返回就绪的分支下标
+ * 1. 从随机位置开始不阻塞地轮询所有分支，避免总是偏向前面的分支
+ * 2. 都没有就绪时，有 default 分支就返回 select_default；否则登记到所有通道上，再轮询一遍后挂起
+ * 3. 被某个通道唤醒后从所有通道上摘下；有缓冲通道的唤醒只表示可以再试，回到第 1 步
+ * 每个通道只唤醒登记在它上面的一个等待者，等待者被唤醒时已经从其他通道的竞争中退出，不会惊群
+ */
+inline int select_wait(select_case_base *const *cases, int count, bool has_default,
+                       std::chrono::steady_clock::time_point const *deadline, bool &ok)
+{
+    thread_local std::minstd_rand engine(std::random_device{}());
+    channel_parker parker;
+    // 被有缓冲通道唤醒、还没有用掉这次唤醒的分支。通道每放入一个元素只唤醒一个等待者，
+    // 这次唤醒如果没有用在这个分支上，要转给该通道的下一个等待者，否则元素留在缓冲中却没人被唤醒
+    int woken = -1;
+    auto finish = [&](int result)
+    {
+        if (woken >= 0 && result != woken)
+        {
+            cases[woken]->forward_wake();
+        }
+        return result;
+    };
+    for (;;)
+    {
+        // 先试唤醒自己的分支，不能让随机起点的其他分支抢先
+        if (woken >= 0 && cases[woken]->poll(nullptr, ok))
+        {
+            return woken;
+        }
+        int const start = count > 1 ? static_cast<int>(engine() % count) : 0;
+        for (int k = 0; k < count; ++k)
+        {
+            int const i = (start + k) % count;
+            if (cases[i]->poll(nullptr, ok))
+            {
+                return finish(i);
+            }
+        }
+        if (has_default)
+        {
+            return finish(select_default);
+        }
+        if (deadline != nullptr && std::chrono::steady_clock::now() >= *deadline)
+        {
+            return finish(select_timeout);
+        }
+
+        parker.begin_poll();
+        for (int i = 0; i < count; ++i)
+        {
+            cases[i]->enlist(&parker, i);
+        }
+        int ready = -1;
+        do
+        {
+            for (int k = 0; k < count && ready < 0; ++k)
+            {
+                int const i = (start + k) % count;
+                if (cases[i]->poll(&parker, ok))
+                {
+                    ready = i;
+                }
+            }
+        } while (ready < 0 && !parker.end_poll());
+        int const fired = ready < 0 ? parker.wait(deadline, select_timeout) : ready;
+        for (int i = 0; i < count; ++i)
+        {
+            cases[i]->delist();
+        }
+        if (fired == ready || fired == select_timeout)
+        {
+            return finish(fired);
+        }
+        if (cases[fired]->completed(ok))
+        {
+            return finish(fired);
+        }
+        // 有缓冲通道的唤醒只表示可以再试；之前没用掉的唤醒先转出去
+        if (woken >= 0 && woken != fired)
+        {
+            cases[woken]->forward_wake();
+        }
+        woken = fired;
+    }
+}
+
+template <typename T>
+class select_send_case;
+template <typename T>
+class select_recv_case;
+
+#ifdef CSP_HAS_COROUTINES
+// 恢复挂起的协程的执行器，不能在调用线程上就地执行任务
+using channel_executor = void (*)(std::function<void()>);
+
+// 默认投递到线程池，线程池已经停止时用一个独立线程执行
+inline void thread_pool_executor(std::function<void()> task)
+{
+    std::future<void> fut = ThreadPool::getInstance()->commit(task);
+    if (!fut.valid())
+    {
+        std::thread(std::move(task)).detach();
+    }
+}
+
+template <typename T>
+class channel_send_awaiter;
+template <typename T>
+class channel_recv_awaiter;
+#endif
+
+/*
+ * 通道
+ * 有缓冲（capacity > 0）：数据放在无锁环形缓冲中，缓冲不满/不空时 send/receive 不加锁也不通知，
+ * 只有真的要挂起时才加锁登记成等待者；对方看到有等待者才加锁唤醒其中一个。
+ * 无缓冲（capacity == 0）：真正的同步交接，send 一直阻塞到某个 receive 直接从它手里取走数据，通道里从不存放数据。
+ * 每个等待者有自己的 parker，一次只唤醒一个，不会惊群。
+ * close 之后 send 返回 false；receive 先取完剩余数据，再返回 false。
+ */
 template <typename T>
 class Channel
 {
 private:
-    std::queue<T> queue_;
+    template <typename U>
+    friend class select_send_case;
+    template <typename U>
+    friend class select_recv_case;
+
+    // 登记在通道上的一次 send 或 receive。无缓冲通道由配对的一方在唤醒前通过 slot 交接数据并置 success；
+    // 有缓冲通道只是被告知"可以再试一次"
+    struct waiter
+    {
+        channel_parker *parker = nullptr;
+        int index = 0;
+        T *slot = nullptr;
+        bool success = false;
+    };
+
+    std::unique_ptr<mpmc_ring<T>> ring_;
     std::mutex mtx_;
-    std::condition_variable cv_producer_;
-    std::condition_variable cv_consumer_;
-    size_t capacity_;
+    std::deque<waiter *> send_waiters_;
+    std::deque<waiter *> recv_waiters_;
+    // 等待者数量，在 mtx_ 内修改，快速路径不加锁读取，为 0 时不用加锁唤醒
+    std::atomic<std::size_t> send_waiting_{0};
+    std::atomic<std::size_t> recv_waiting_{0};
     bool closed_ = false;
+    size_t capacity_;
 
 public:
-    Channel(size_t capacity = 0) : capacity_(capacity) {}
+    Channel(size_t capacity = 0) : capacity_(capacity)
+    {
+        if (capacity_ > 0)
+        {
+            ring_.reset(new mpmc_ring<T>(capacity_));
+        }
+    }
+
+    Channel(Channel const &) = delete;
+    Channel &operator=(Channel const &) = delete;
 
-    bool send(T value)
+    bool send(T const &value)
     {
-        std::unique_lock<std::mutex> lock(mtx_);
-        cv_producer_.wait(lock, [this]()
-                          {
-            // 对于无缓冲的channel，我们应该等待直到有消费者准备好
-            return (capacity_ == 0 && queue_.empty()) || queue_.size() < capacity_ || closed_; });
+        T copy(value);
+        return send(std::move(copy));
+    }
 
-        if (closed_)
+    // 有缓冲时元素被移动进环形缓冲，无缓冲时由接收方直接从 value 移走，全程不拷贝
+    bool send(T &&value)
+    {
+        select_send_case<T> c(*this, value);
+        return run_single(c);
+    }
+
+    // 缓冲有空位时直接在格子中构造元素
+    template <typename... Args>
+    bool emplace(Args &&...args)
+    {
+        if (ring_)
         {
-            return false;
+            typename mpmc_ring<T>::result const res = ring_->try_emplace(std::forward<Args>(args)...);
+            if (res == mpmc_ring<T>::ok)
+            {
+                wake(recv_waiters_, recv_waiting_, 1);
+                return true;
+            }
+            if (res == mpmc_ring<T>::closed)
+            {
+                return false;
+            }
         }
+        return send(T(std::forward<Args>(args)...));
+    }
 
-        queue_.push(value);
-        cv_consumer_.notify_one();
-        return true;
+    /*
+     * 批量发送 [first, last)，返回发送成功的个数，通道关闭时可能少于元素个数
+     * 有缓冲时一次占下尽可能多的连续空位，一批只做一次唤醒检查；缓冲满时退化成逐个阻塞发送。
+     * 元素按 *first 的值类别拷贝或移动，传入 std::make_move_iterator 可以避免拷贝
+     */
+    template <typename ForwardIt>
+    std::size_t send_batch(ForwardIt first, ForwardIt last)
+    {
+        std::size_t sent = 0;
+        std::size_t remaining = static_cast<std::size_t>(std::distance(first, last));
+        while (remaining > 0)
+        {
+            if (ring_)
+            {
+                typename mpmc_ring<T>::result status;
+                std::size_t const pushed = ring_->try_push_batch(first, remaining, status);
+                if (pushed > 0)
+                {
+                    wake(recv_waiters_, recv_waiting_, pushed);
+                    sent += pushed;
+                    remaining -= pushed;
+                    continue;
+                }
+                if (status == mpmc_ring<T>::closed)
+                {
+                    break;
+                }
+            }
+            if (!send(*first))
+            {
+                break;
+            }
+            ++first;
+            ++sent;
+            --remaining;
+        }
+        return sent;
+    }
+
+    template <typename Range>
+    std::size_t send_batch(Range &&range)
+    {
+        return send_batch(std::begin(range), std::end(range));
+    }
+
+    /*
+     * 最多接收 n 个元素写入 out，返回接收的个数
+     * 没有数据时阻塞等待第一个，之后只取当时已经就绪的部分，不再阻塞；通道关闭且取完时返回 0
+     */
+    template <typename OutputIt>
+    std::size_t receive_up_to(std::size_t n, OutputIt out)
+    {
+        if (n == 0)
+        {
+            return 0;
+        }
+        std::size_t received = 0;
+        if (ring_)
+        {
+            typename mpmc_ring<T>::result status;
+            received = ring_->try_pop_batch(out, n, status);
+            if (received > 0)
+            {
+                wake(send_waiters_, send_waiting_, received);
+                return received;
+            }
+        }
+        T value;
+        if (!receive(value))
+        {
+            return 0;
+        }
+        *out = std::move(value);
+        ++out;
+        received = 1;
+        if (ring_)
+        {
+            typename mpmc_ring<T>::result status;
+            std::size_t const more = ring_->try_pop_batch(out, n - received, status);
+            if (more > 0)
+            {
+                wake(send_waiters_, send_waiting_, more);
+                received += more;
+            }
+        }
+        else
+        {
+            bool ok = false;
+            while (received < n && poll_receive(value, nullptr, ok) && ok)
+            {
+                *out = std::move(value);
+                ++out;
+                ++received;
+            }
+        }
+        return received;
     }
 
     bool receive(T &value)
     {
-        std::unique_lock<std::mutex> lock(mtx_);
-        cv_consumer_.wait(lock, [this]()
-                          { return !queue_.empty() || closed_; });
+        select_recv_case<T> c(*this, value);
+        return run_single(c);
+    }
 
-        if (closed_ && queue_.empty())
+    // 在 deadline 之前收到数据返回 ok；挂起时由 parker 的条件变量计时，不占用额外的线程
+    channel_status receive_until(T &value, std::chrono::steady_clock::time_point deadline)
+    {
+        select_recv_case<T> c(*this, value);
+        select_case_base *cases[1] = {&c};
+        bool ok = false;
+        if (select_wait(cases, 1, false, &deadline, ok) == select_timeout)
         {
-            return false;
+            return channel_status::timeout;
         }
+        return ok ? channel_status::ok : channel_status::closed;
+    }
 
-        value = queue_.front();
-        queue_.pop();
-        cv_producer_.notify_one();
-        return true;
+    template <typename Rep, typename Period>
+    channel_status receive_for(T &value, std::chrono::duration<Rep, Period> const &timeout)
+    {
+        return receive_until(value, std::chrono::steady_clock::now() +
+                                        std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout));
     }
 
+#ifdef CSP_HAS_COROUTINES
+    // co_await ch.async_send(v)：通道关闭时结果为 false，需要等待时挂起协程而不阻塞线程
+    channel_send_awaiter<T> async_send(T value, channel_executor executor = thread_pool_executor)
+    {
+        return channel_send_awaiter<T>(*this, std::move(value), executor);
+    }
+
+    // co_await ch.async_receive()：通道关闭且取完时结果为空
+    channel_recv_awaiter<T> async_receive(channel_executor executor = thread_pool_executor)
+    {
+        return channel_recv_awaiter<T>(*this, executor);
+    }
+#endif
+
     void close()
     {
-        std::unique_lock<std::mutex> lock(mtx_);
+        std::lock_guard<std::mutex> lock(mtx_);
         closed_ = true;
-        cv_producer_.notify_all();
-        cv_consumer_.notify_all();
+        if (ring_)
+        {
+            ring_->close();
+        }
+        // 唤醒所有等待者，它们重新轮询时会看到通道已关闭
+        for (std::deque<waiter *> *waiters : {&send_waiters_, &recv_waiters_})
+        {
+            for (waiter *w : *waiters)
+            {
+                w->parker->try_fire(w->index, []() {});
+            }
+            waiters->clear();
+        }
+        send_waiting_.store(0, std::memory_order_relaxed);
+        recv_waiting_.store(0, std::memory_order_relaxed);
+    }
+
+    size_t capacity() const
+    {
+        return capacity_;
+    }
+
+    // 缓冲中元素个数的近似值，无缓冲通道总是 0
+    size_t size() const
+    {
+        return ring_ ? ring_->approximate_size() : 0;
+    }
+
+private:
+    static bool run_single(select_case_base &c)
+    {
+        select_case_base *cases[1] = {&c};
+        bool ok = false;
+        select_wait(cases, 1, false, nullptr, ok);
+        return ok;
+    }
+
+    bool buffered() const
+    {
+        return ring_ != nullptr;
+    }
+
+    // 不阻塞地发送一次，只有成功时 value 才被移走
+    bool poll_send(T &value, channel_parker *self, bool &ok)
+    {
+        if (ring_)
+        {
+            typename mpmc_ring<T>::result const res = ring_->try_push(std::move(value));
+            if (res == mpmc_ring<T>::full)
+            {
+                return false;
+            }
+            ok = res == mpmc_ring<T>::ok;
+            if (ok)
+            {
+                wake(recv_waiters_, recv_waiting_, 1);
+            }
+            return true;
+        }
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (closed_)
+        {
+            ok = false;
+            return true;
+        }
+        ok = hand_over(recv_waiters_, recv_waiting_, self, [&value](waiter &r)
+                       { *r.slot = std::move(value); });
+        return ok;
+    }
+
+    bool poll_receive(T &value, channel_parker *self, bool &ok)
+    {
+        if (ring_)
+        {
+            typename mpmc_ring<T>::result const res = ring_->try_pop(value);
+            if (res == mpmc_ring<T>::empty)
+            {
+                return false;
+            }
+            ok = res == mpmc_ring<T>::ok;
+            if (ok)
+            {
+                wake(send_waiters_, send_waiting_, 1);
+            }
+            return true;
+        }
+        std::lock_guard<std::mutex> lock(mtx_);
+        ok = hand_over(send_waiters_, send_waiting_, self, [&value](waiter &s)
+                       { value = std::move(*s.slot); });
+        return ok || closed_;
+    }
+
+    void enlist(bool sending, waiter &w)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        std::deque<waiter *> &waiters = sending ? send_waiters_ : recv_waiters_;
+        std::atomic<std::size_t> &count = sending ? send_waiting_ : recv_waiting_;
+        waiters.push_back(&w);
+        // 与 wake 中的 fence 配对：要么对方看到等待者，要么之后的轮询看到对方放入的数据
+        count.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    // 已经被唤醒的等待者不在队列中
+    void delist(bool sending, waiter &w)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        std::deque<waiter *> &waiters = sending ? send_waiters_ : recv_waiters_;
+        auto it = std::find(waiters.begin(), waiters.end(), &w);
+        if (it != waiters.end())
+        {
+            waiters.erase(it);
+            (sending ? send_waiting_ : recv_waiting_).fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    // 调用方持有 mtx_。按登记顺序唤醒一个等待者，唤醒前执行 transfer；跳过自己和正在轮询的等待者
+    template <typename Transfer>
+    bool hand_over(std::deque<waiter *> &waiters, std::atomic<std::size_t> &count, channel_parker *self, Transfer transfer)
+    {
+        for (auto it = waiters.begin(); it != waiters.end();)
+        {
+            waiter *w = *it;
+            if (w->parker == self)
+            {
+                ++it;
+                continue;
+            }
+            typename channel_parker::fire_result const res = w->parker->try_fire(w->index, [&]()
+                                                                                 {
+                transfer(*w);
+                w->success = true; });
+            if (res == channel_parker::fire_busy)
+            {
+                ++it;
+                continue;
+            }
+            it = waiters.erase(it);
+            count.fetch_sub(1, std::memory_order_relaxed);
+            if (res == channel_parker::fire_ok)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // 有缓冲通道：放入或取出 n 个元素后最多唤醒对方的 n 个等待者，一批只加一次锁
+    void wake(std::deque<waiter *> &waiters, std::atomic<std::size_t> &count, std::size_t n)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (count.load(std::memory_order_relaxed) == 0)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mtx_);
+        for (std::size_t i = 0; i < n && hand_over(waiters, count, nullptr, [](waiter &) {}); ++i)
+        {
+        }
+    }
+};
+
+template <typename T>
+class select_send_case : public select_case_base
+{
+public:
+    select_send_case(Channel<T> &ch_, T &value_) : ch(ch_), value(value_) {}
+
+    bool poll(channel_parker *self, bool &ok) override
+    {
+        return ch.poll_send(value, self, ok);
+    }
+
+    void enlist(channel_parker *parker, int index) override
+    {
+        node.parker = parker;
+        node.index = index;
+        node.slot = &value;
+        node.success = false;
+        ch.enlist(true, node);
+    }
+
+    void delist() override
+    {
+        ch.delist(true, node);
+    }
+
+    bool completed(bool &ok) override
+    {
+        ok = node.success;
+        return !ch.buffered();
+    }
+
+    void forward_wake() override
+    {
+        ch.wake(ch.send_waiters_, ch.send_waiting_, 1);
+    }
+
+private:
+    Channel<T> &ch;
+    T &value;
+    typename Channel<T>::waiter node;
+};
+
+template <typename T>
+class select_recv_case : public select_case_base
+{
+public:
+    select_recv_case(Channel<T> &ch_, T &out_) : ch(ch_), out(out_) {}
+
+    bool poll(channel_parker *self, bool &ok) override
+    {
+        return ch.poll_receive(out, self, ok);
+    }
+
+    void enlist(channel_parker *parker, int index) override
+    {
+        node.parker = parker;
+        node.index = index;
+        node.slot = &out;
+        node.success = false;
+        ch.enlist(false, node);
+    }
+
+    void delist() override
+    {
+        ch.delist(false, node);
+    }
+
+    bool completed(bool &ok) override
+    {
+        ok = node.success;
+        return !ch.buffered();
+    }
+
+    void forward_wake() override
+    {
+        ch.wake(ch.recv_waiters_, ch.recv_waiting_, 1);
+    }
+
+private:
+    Channel<T> &ch;
+    T &out;
+    typename Channel<T>::waiter node;
+};
+
+/*
+ * Go 风格的多路选择
+ *   channel_select sel;
+ *   sel.recv(data, item, [&](bool ok) { ... })
+ *      .recv(cancel, flag, [&](bool) { stop = true; })
+ *      .otherwise([&]() { ... });          // 可选的 default 分支
+ *   sel.wait_for(std::chrono::milliseconds(100));
+ * 返回就绪分支的下标（按添加顺序），并调用它的处理函数，参数为 false 表示通道已关闭；
+ * 有 default 分支且没有分支就绪时返回 select_default，超时返回 select_timeout。
+ * 接收分支可以反复 wait；发送分支的值发送成功后就被移走了
+ */
+class channel_select
+{
+public:
+    template <typename T>
+    channel_select &recv(Channel<T> &ch, T &out, std::function<void(bool)> handler = nullptr)
+    {
+        cases.emplace_back(new select_recv_case<T>(ch, out));
+        cases.back()->handler = std::move(handler);
+        return *this;
+    }
+
+    template <typename T>
+    channel_select &send(Channel<T> &ch, T value, std::function<void(bool)> handler = nullptr)
+    {
+        cases.emplace_back(new owned_send_case<T>(ch, std::move(value)));
+        cases.back()->handler = std::move(handler);
+        return *this;
+    }
+
+    channel_select &otherwise(std::function<void()> handler = nullptr)
+    {
+        has_default = true;
+        default_handler = std::move(handler);
+        return *this;
+    }
+
+    int wait()
+    {
+        return run(nullptr);
+    }
+
+    int wait_until(std::chrono::steady_clock::time_point deadline)
+    {
+        return run(&deadline);
+    }
+
+    template <typename Rep, typename Period>
+    int wait_for(std::chrono::duration<Rep, Period> const &timeout)
+    {
+        return wait_until(std::chrono::steady_clock::now() +
+                          std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout));
+    }
+
+    // 上一次 wait 就绪的分支是否成功
+    bool ok() const
+    {
+        return last_ok;
+    }
+
+private:
+    template <typename T>
+    struct send_value
+    {
+        T value;
+    };
+
+    // 先构造基类 send_value 保存要发送的值，再让 select_send_case 引用它
+    template <typename T>
+    class owned_send_case : private send_value<T>, public select_send_case<T>
+    {
+    public:
+        owned_send_case(Channel<T> &ch, T value)
+            : send_value<T>{std::move(value)}, select_send_case<T>(ch, send_value<T>::value)
+        {
+        }
+    };
+
+    int run(std::chrono::steady_clock::time_point const *deadline)
+    {
+        std::vector<select_case_base *> raw;
+        raw.reserve(cases.size());
+        for (auto &c : cases)
+        {
+            raw.push_back(c.get());
+        }
+        last_ok = false;
+        int const index = select_wait(raw.data(), static_cast<int>(raw.size()), has_default, deadline, last_ok);
+        if (index >= 0 && cases[index]->handler)
+        {
+            cases[index]->handler(last_ok);
+        }
+        else if (index == select_default && default_handler)
+        {
+            default_handler();
+        }
+        return index;
+    }
+
+    std::vector<std::unique_ptr<select_case_base>> cases;
+    bool has_default = false;
+    std::function<void()> default_handler;
+    bool last_ok = false;
+};
+
+#ifdef CSP_HAS_COROUTINES
+/*
+ * 挂起协程的通道操作
+ * 与 select_wait 走同一套登记协议，只是挂起的是协程：
+ * 1. await_ready 不阻塞地尝试一次，成功就不挂起
+ * 2. await_suspend 登记到通道上再轮询一遍，仍未就绪就挂起，协程句柄留在 parker 的 notify 里
+ * 3. 被唤醒时把 resume 投递到执行器，在执行器线程上摘下登记；有缓冲通道的唤醒只表示可以再试，
+ *    再试失败就重新登记，不恢复协程
+ * 挂起的协程只占一个协程帧，不占线程，大量的协程流水线可以共享少量线程
+ */
+template <typename T, typename Case>
+class channel_awaiter
+{
+public:
+    channel_awaiter(channel_awaiter const &) = delete;
+    channel_awaiter &operator=(channel_awaiter const &) = delete;
+
+    bool await_ready()
+    {
+        return c.poll(nullptr, ok);
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle_)
+    {
+        handle = handle_;
+        parker.set_notify(&channel_awaiter::on_fire, this);
+        // 返回之后协程可能已经在别的线程上恢复，不能再访问成员
+        return !enlist_and_poll();
+    }
+
+protected:
+    channel_awaiter(Channel<T> &ch, T &slot, channel_executor executor_) : c(ch, slot), executor(executor_) {}
+
+    Case c;
+    bool ok = false;
+
+private:
+    // 登记并再轮询一遍，就绪时摘下登记并返回 true
+    bool enlist_and_poll()
+    {
+        parker.begin_poll();
+        c.enlist(&parker, 0);
+        bool ready = false;
+        do
+        {
+            ready = c.poll(&parker, ok);
+        } while (!ready && !parker.end_poll());
+        if (ready)
+        {
+            c.delist();
+        }
+        return ready;
+    }
+
+    // 唤醒方持有通道锁时调用，delist 要等唤醒方释放通道锁，之后 parker 才可以随协程帧一起销毁
+    static void on_fire(void *self)
+    {
+        channel_awaiter *awaiter = static_cast<channel_awaiter *>(self);
+        awaiter->executor([awaiter]()
+                          { awaiter->resume(); });
+    }
+
+    void resume()
+    {
+        c.delist();
+        if (c.completed(ok) || c.poll(nullptr, ok) || enlist_and_poll())
+        {
+            handle.resume();
+        }
+    }
+
+    channel_parker parker;
+    channel_executor executor;
+    std::coroutine_handle<> handle;
+};
+
+template <typename T>
+struct channel_awaiter_value
+{
+    T value;
+};
+
+// 先构造基类 channel_awaiter_value 保存值，再让分支引用它
+template <typename T>
+class channel_send_awaiter : private channel_awaiter_value<T>, public channel_awaiter<T, select_send_case<T>>
+{
+public:
+    channel_send_awaiter(Channel<T> &ch, T value, channel_executor executor)
+        : channel_awaiter_value<T>{std::move(value)},
+          channel_awaiter<T, select_send_case<T>>(ch, channel_awaiter_value<T>::value, executor)
+    {
+    }
+
+    bool await_resume()
+    {
+        return this->ok;
     }
 };
 
+template <typename T>
+class channel_recv_awaiter : private channel_awaiter_value<T>, public channel_awaiter<T, select_recv_case<T>>
+{
+public:
+    channel_recv_awaiter(Channel<T> &ch, channel_executor executor)
+        : channel_awaiter_value<T>{T()},
+          channel_awaiter<T, select_recv_case<T>>(ch, channel_awaiter_value<T>::value, executor)
+    {
+    }
+
+    std::optional<T> await_resume()
+    {
+        if (!this->ok)
+        {
+            return std::nullopt;
+        }
+        return std::optional<T>(std::move(channel_awaiter_value<T>::value));
+    }
+};
+#endif
+
 // 示例使用
 void test_csp()
 {
@@ -84,4 +1248,234 @@ void test_csp()
 
     producer.join();
     consumer.join();
-}
\ No newline at end of file
+}
+
+// 无缓冲通道：send 返回时数据一定已经被某个 receive 取走
+void test_csp_rendezvous()
+{
+    Channel<int> ch; // 无缓冲
+    std::atomic<int> received{-1};
+
+    std::thread consumer([&]()
+                         {
+        int val;
+        while (ch.receive(val)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            received = val;
+        } });
+
+    for (int i = 0; i < 5; ++i)
+    {
+        ch.send(i);
+        // 交接发生在 send 返回之前，所以消费者最多落后一个
+        std::cout << "Sent: " << i << ", consumer at least got " << i - 1 << std::endl;
+    }
+    ch.close();
+    consumer.join();
+    std::cout << "last received " << received << std::endl;
+
+    // 多生产者多消费者压测有缓冲通道
+    Channel<long> buffered(64);
+    std::atomic<long> sum{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+    {
+        threads.emplace_back([&]()
+                             {
+            long val;
+            while (buffered.receive(val)) {
+                sum += val;
+            } });
+    }
+    std::vector<std::thread> producers;
+    for (int t = 0; t < 4; t++)
+    {
+        producers.emplace_back([&, t]()
+                               {
+            for (long i = 1; i <= 20000; i++) {
+                buffered.send(t * 20000 + i);
+            } });
+    }
+    for (auto &th : producers)
+    {
+        th.join();
+    }
+    buffered.close();
+    for (auto &th : threads)
+    {
+        th.join();
+    }
+    std::cout << "sum is " << sum << ", expected " << 80000L * 80001 / 2 << std::endl;
+}
+
+// 一个消费者同时等待数据、控制和取消三个通道
+void test_csp_select()
+{
+    Channel<int> data(16);
+    Channel<std::string> control; // 无缓冲
+    Channel<bool> cancel(1);
+
+    std::thread producer([&]()
+                         {
+        for (int i = 0; i < 100; ++i) {
+            data.send(i);
+        }
+        control.send("flush");
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        cancel.send(true); });
+
+    int item = 0;
+    std::string command;
+    bool flag = false;
+    long sum = 0;
+    bool stop = false;
+    channel_select sel;
+    sel.recv(data, item, [&](bool ok)
+             { if (ok) sum += item; })
+        .recv(control, command, [&](bool ok)
+              { if (ok) std::cout << "control: " << command << std::endl; })
+        .recv(cancel, flag, [&](bool)
+              { stop = true; });
+    int timeouts = 0;
+    while (!stop)
+    {
+        if (sel.wait_for(std::chrono::milliseconds(10)) == select_timeout)
+        {
+            ++timeouts;
+        }
+    }
+    producer.join();
+    std::cout << "sum is " << sum << ", expected " << 99 * 100 / 2 << ", timeouts " << timeouts << std::endl;
+
+    // default 分支：没有分支就绪时立即返回
+    channel_select poll;
+    poll.recv(data, item).otherwise([]()
+                                    { std::cout << "nothing ready" << std::endl; });
+    int const polled = poll.wait();
+    std::cout << "poll returned " << polled << std::endl;
+
+    // 发送分支：同时向两个无缓冲通道发送，只有一个会被取走
+    Channel<int> left;
+    Channel<int> right;
+    int taken = 0;
+    std::thread taker([&]()
+                      { right.receive(taken); });
+    channel_select both;
+    both.send(left, 1).send(right, 2);
+    int const index = both.wait();
+    taker.join();
+    std::cout << "send case " << index << " was taken, right received " << taken << std::endl;
+}
+
+namespace csp_test
+{
+    std::atomic<long> payload_copies{0};
+
+    // 大块数据，统计被拷贝的次数
+    struct payload
+    {
+        std::vector<char> bytes;
+        payload() {}
+        explicit payload(std::size_t n) : bytes(n) {}
+        payload(payload const &other) : bytes(other.bytes) { payload_copies++; }
+        payload(payload &&other) = default;
+        payload &operator=(payload const &other)
+        {
+            bytes = other.bytes;
+            payload_copies++;
+            return *this;
+        }
+        payload &operator=(payload &&other) = default;
+    };
+}
+
+// 移动发送、原地构造和批量收发
+void test_csp_batch()
+{
+    using csp_test::payload;
+    Channel<payload> ch(256);
+    std::atomic<long> bytes{0};
+    std::thread consumer([&]()
+                         {
+        std::vector<payload> batch;
+        std::size_t n;
+        while ((n = ch.receive_up_to(64, std::back_inserter(batch))) > 0) {
+            for (payload &p : batch) {
+                bytes += static_cast<long>(p.bytes.size());
+            }
+            batch.clear();
+        } });
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        ch.send(payload(1024));
+        ch.emplace(1024);
+    }
+    std::vector<payload> burst(1000, payload(1024));
+    long const copies_before = csp_test::payload_copies;
+    ch.send_batch(std::make_move_iterator(burst.begin()), std::make_move_iterator(burst.end()));
+    ch.close();
+    consumer.join();
+    std::cout << "received bytes " << bytes << ", expected " << 3000L * 1024
+              << ", copies while sending " << csp_test::payload_copies - copies_before << std::endl;
+}
+
+#ifdef CSP_HAS_COROUTINES
+// 不关心结果的协程，创建后立即执行，结束时自动销毁协程帧
+struct channel_coroutine
+{
+    struct promise_type
+    {
+        channel_coroutine get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+/* 测试：一万条"生产者协程 -> 无缓冲通道 -> 消费者协程"流水线跑在线程池的几个线程上 */
+void test_csp_coroutine()
+{
+    int const pipelines = 10000;
+    int const items = 10;
+    std::vector<std::unique_ptr<Channel<int>>> channels;
+    std::atomic<long> sum{0};
+    std::atomic<int> remaining{pipelines};
+    std::mutex done_mutex;
+    std::condition_variable done_cv;
+
+    auto producer = [](Channel<int> &ch, int n) -> channel_coroutine
+    {
+        for (int i = 1; i <= n; ++i)
+        {
+            co_await ch.async_send(i);
+        }
+        ch.close();
+    };
+    auto consumer = [&](Channel<int> &ch) -> channel_coroutine
+    {
+        while (std::optional<int> value = co_await ch.async_receive())
+        {
+            sum += *value;
+        }
+        if (remaining.fetch_sub(1) == 1)
+        {
+            std::lock_guard<std::mutex> lock(done_mutex);
+            done_cv.notify_one();
+        }
+    };
+
+    for (int p = 0; p < pipelines; ++p)
+    {
+        channels.emplace_back(new Channel<int>(p % 2 == 0 ? 0 : 4));
+        consumer(*channels.back());
+        producer(*channels.back(), items);
+    }
+    std::unique_lock<std::mutex> lock(done_mutex);
+    done_cv.wait(lock, [&]()
+                 { return remaining.load() == 0; });
+    std::cout << "coroutine pipelines " << pipelines << ", sum is " << sum
+              << ", expected " << static_cast<long>(pipelines) * items * (items + 1) / 2 << std::endl;
+}
+#endif
@@ -0,0 +1,297 @@
+#pragma once
+
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <random>
+#include <type_traits>
+
+/*
+ * 并发优先队列（松弛的多队列 MultiQueue）
+ * 一把锁保护的 std::priority_queue 上所有线程都在争同一把锁、同一个堆顶。多队列把元素分散到 c * 线程数 个小堆中：
+ * 1. push 随机选一个小堆，try_lock 失败就换一个，几乎不会阻塞
+ * 2. pop 随机选两个小堆，比较缓存的堆顶优先级（不加锁），从较小的那个弹出（two-choice）
+ * 3. 两个都为空时依次扫描所有小堆，扫描一遍都为空才返回失败
+ * 弹出的不一定是全局最小，但期望排名误差是 O(小堆个数)，适合按截止时间派发任务这类允许少量乱序的场景
+ * Priority 需要可平凡复制，每个小堆用一个原子变量缓存堆顶优先级，比较时不用加锁
+ */
+template <typename Priority, typename Value, typename Compare = std::less<Priority>>
+class concurrent_priority_queue
+{
+    static_assert(std::is_trivially_copyable<Priority>::value, "Priority is cached in an atomic");
+
+    struct entry
+    {
+        Priority priority;
+        Value value;
+    };
+
+    // std::push_heap 建大顶堆，比较取反得到小顶堆
+    struct entry_greater
+    {
+        Compare comp;
+        bool operator()(entry const &lhs, entry const &rhs) const
+        {
+            return comp(rhs.priority, lhs.priority);
+        }
+    };
+
+    struct alignas(64) shard_type
+    {
+        std::mutex mutex;
+        std::vector<entry> heap;
+        // 以下两个缓存只在持有 mutex 时写，选择小堆时不加锁读
+        std::atomic<bool> nonempty{false};
+        std::atomic<Priority> top{};
+    };
+
+public:
+    explicit concurrent_priority_queue(unsigned shards_per_thread = 2, Compare comp_ = Compare())
+        : comp(comp_)
+    {
+        unsigned const threads = std::max(1u, std::thread::hardware_concurrency());
+        shard_count = std::max(2u, shards_per_thread * threads);
+        shards.reset(new shard_type[shard_count]);
+    }
+
+    concurrent_priority_queue(concurrent_priority_queue const &) = delete;
+    concurrent_priority_queue &operator=(concurrent_priority_queue const &) = delete;
+
+    void push(Priority const &priority, Value value)
+    {
+        unsigned index = random_below(shard_count);
+        std::unique_lock<std::mutex> lock(shards[index].mutex, std::try_to_lock);
+        // 被别的线程占着就换一个，最后一次直接阻塞等待
+        for (unsigned attempt = 0; !lock.owns_lock(); ++attempt)
+        {
+            index = random_below(shard_count);
+            if (attempt < shard_count)
+            {
+                lock = std::unique_lock<std::mutex>(shards[index].mutex, std::try_to_lock);
+            }
+            else
+            {
+                lock = std::unique_lock<std::mutex>(shards[index].mutex);
+            }
+        }
+        shard_type &shard = shards[index];
+        shard.heap.push_back(entry{priority, std::move(value)});
+        std::push_heap(shard.heap.begin(), shard.heap.end(), entry_greater{comp});
+        publish_top(shard);
+        lock.unlock();
+
+        // 与 wait_pop_min 中的 waiters 自增配对，保证等待者要么看到新元素，要么被唤醒
+        if (waiters.load(std::memory_order_seq_cst) != 0)
+        {
+            std::lock_guard<std::mutex> wait_lock(wait_mutex);
+            wait_cv.notify_one();
+        }
+    }
+
+    // 弹出一个近似最小的元素，所有小堆都为空时返回 false
+    bool try_pop_min(Priority &priority, Value &value)
+    {
+        for (unsigned attempt = 0; attempt < shard_count; ++attempt)
+        {
+            unsigned const first = random_below(shard_count);
+            unsigned const second = random_below(shard_count);
+            unsigned const index = better(first, second);
+            if (!shards[index].nonempty.load(std::memory_order_relaxed))
+            {
+                // 两个都为空，队列多半快空了，直接扫描
+                break;
+            }
+            std::unique_lock<std::mutex> lock(shards[index].mutex, std::try_to_lock);
+            if (lock.owns_lock() && pop_locked(shards[index], priority, value))
+            {
+                return true;
+            }
+        }
+        // 逐个加锁扫描，保证只有在每个小堆被检查时都为空才返回 false
+        unsigned const start = random_below(shard_count);
+        for (unsigned i = 0; i < shard_count; ++i)
+        {
+            shard_type &shard = shards[(start + i) % shard_count];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            if (pop_locked(shard, priority, value))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool try_pop_min(Value &value)
+    {
+        Priority priority;
+        return try_pop_min(priority, value);
+    }
+
+    // 队列为空时阻塞，直到有元素可以弹出
+    void wait_pop_min(Priority &priority, Value &value)
+    {
+        if (try_pop_min(priority, value))
+        {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(wait_mutex);
+        waiters.fetch_add(1, std::memory_order_seq_cst);
+        while (!try_pop_min(priority, value))
+        {
+            wait_cv.wait(lock);
+        }
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void wait_pop_min(Value &value)
+    {
+        Priority priority;
+        wait_pop_min(priority, value);
+    }
+
+    // 不加锁读缓存，并发修改时只是一个近似值
+    bool empty() const
+    {
+        for (unsigned i = 0; i < shard_count; ++i)
+        {
+            if (shards[i].nonempty.load(std::memory_order_relaxed))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    unsigned shards_size() const
+    {
+        return shard_count;
+    }
+
+private:
+    static unsigned random_below(unsigned bound)
+    {
+        thread_local std::minstd_rand engine(std::random_device{}());
+        return static_cast<unsigned>(engine() % bound);
+    }
+
+    // 两个小堆中堆顶优先级更小的一个，空的小堆排在最后
+    unsigned better(unsigned first, unsigned second) const
+    {
+        bool const first_nonempty = shards[first].nonempty.load(std::memory_order_relaxed);
+        bool const second_nonempty = shards[second].nonempty.load(std::memory_order_relaxed);
+        if (!first_nonempty || !second_nonempty)
+        {
+            return first_nonempty ? first : second;
+        }
+        Priority const first_top = shards[first].top.load(std::memory_order_relaxed);
+        Priority const second_top = shards[second].top.load(std::memory_order_relaxed);
+        return comp(second_top, first_top) ? second : first;
+    }
+
+    void publish_top(shard_type &shard)
+    {
+        if (shard.heap.empty())
+        {
+            shard.nonempty.store(false, std::memory_order_relaxed);
+        }
+        else
+        {
+            shard.top.store(shard.heap.front().priority, std::memory_order_relaxed);
+            shard.nonempty.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    // 调用方持有 shard.mutex
+    bool pop_locked(shard_type &shard, Priority &priority, Value &value)
+    {
+        if (shard.heap.empty())
+        {
+            return false;
+        }
+        std::pop_heap(shard.heap.begin(), shard.heap.end(), entry_greater{comp});
+        priority = shard.heap.back().priority;
+        value = std::move(shard.heap.back().value);
+        shard.heap.pop_back();
+        publish_top(shard);
+        return true;
+    }
+
+    Compare comp;
+    unsigned shard_count;
+    std::unique_ptr<shard_type[]> shards;
+
+    std::mutex wait_mutex;
+    std::condition_variable wait_cv;
+    std::atomic<unsigned> waiters{0};
+};
+
+/* 测试：多个线程按随机截止时间投递任务，消费者阻塞弹出，统计弹出顺序的逆序程度 */
+void TestConcurrentPriorityQueue()
+{
+    concurrent_priority_queue<long, long> queue;
+    std::vector<std::thread> producers;
+    for (int t = 0; t < 4; t++)
+    {
+        producers.emplace_back([&, t]()
+                               {
+            std::minstd_rand engine(t + 1);
+            for (int i = 0; i < 20000; i++)
+            {
+                long deadline = static_cast<long>(engine() % 1000000);
+                queue.push(deadline, deadline);
+            } });
+    }
+    for (auto &th : producers)
+    {
+        th.join();
+    }
+
+    // 单个消费者顺序弹出，相邻两次弹出优先级变小记为一次逆序
+    long popped = 0;
+    long inversions = 0;
+    long last = -1;
+    long priority = 0;
+    long value = 0;
+    while (queue.try_pop_min(priority, value))
+    {
+        if (priority < last)
+        {
+            inversions++;
+        }
+        last = priority;
+        popped++;
+    }
+    std::cout << "popped " << popped << ", inversions " << inversions
+              << ", shards " << queue.shards_size() << std::endl;
+
+    // 消费者先阻塞等待，生产者随后投递
+    std::atomic<long> sum{0};
+    std::vector<std::thread> consumers;
+    for (int t = 0; t < 4; t++)
+    {
+        consumers.emplace_back([&]()
+                               {
+            for (int i = 0; i < 1000; i++)
+            {
+                long p = 0;
+                long v = 0;
+                queue.wait_pop_min(p, v);
+                sum += v;
+            } });
+    }
+    for (long i = 1; i <= 4000; i++)
+    {
+        queue.push(i, i);
+    }
+    for (auto &th : consumers)
+    {
+        th.join();
+    }
+    std::cout << "wait pop sum is " << sum << ", expected " << 4000L * 4001 / 2 << std::endl;
+}
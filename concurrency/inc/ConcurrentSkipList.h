@@ -0,0 +1,519 @@
+#pragma once
+
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <random>
+#include <functional>
+#include <new>
+#include <cstdint>
+#include "EpochReclaim.h"
+
+/*
+ * 无锁有序跳表，double_push_list 的查找、删除、按位置插入都是 O(n) 的逐节点加锁遍历，这里是 O(log n)
+ * 1. 每个节点有 height 层后继指针，指针最低位作为删除标记：
+ *    删除时从最高层到第 0 层依次给节点自己的后继指针打标记，第 0 层打标记成功的线程赢得删除，
+ *    之后任何线程的 find 经过被标记的节点时都会用 CAS 把它从该层摘掉
+ * 2. 插入先在第 0 层用 CAS 链入（此时插入生效），再逐层链入上层；发现自己被标记了就停止
+ * 3. 节点用纪元回收释放，所有操作都在 pin 住的临界区内进行，遍历过程中节点不会被释放
+ * 4. 插入者链入上层的 CAS 不检查节点自己的标记，删除者摘掉节点之后插入者仍可能把它重新链入某一层，
+ *    所以插入者和删除者各持有节点的一份所有权，两边都做完之后，最后放手的一方再 find 一次把它从所有层摘掉并退休
+ * 值在插入后不可修改，需要修改时先 erase 再 insert
+ */
+template <typename Key, typename Value, typename Compare = std::less<Key>>
+class concurrent_skip_list_map
+{
+private:
+    static constexpr int max_level = 24;
+    typedef std::atomic<std::uintptr_t> link_type;
+
+    struct node
+    {
+        Key key;
+        Value value;
+        int height;
+        // 链入上层的插入者和赢得删除的删除者各一份
+        std::atomic<int> owners{2};
+
+        node(Key const &key_, Value const &value_, int height_) : key(key_), value(value_), height(height_) {}
+    };
+
+    // 后继指针数组紧跟在节点后面，与节点一起分配，每个节点只分配一次
+    static constexpr std::size_t links_offset = (sizeof(node) + alignof(link_type) - 1) / alignof(link_type) * alignof(link_type);
+
+    static link_type *links(node *n)
+    {
+        return reinterpret_cast<link_type *>(reinterpret_cast<char *>(n) + links_offset);
+    }
+
+    static node *create_node(Key const &key, Value const &value, int height)
+    {
+        void *mem = ::operator new(links_offset + sizeof(link_type) * height);
+        node *n = new (mem) node(key, value, height);
+        for (int i = 0; i < height; ++i)
+        {
+            new (links(n) + i) link_type(0);
+        }
+        return n;
+    }
+
+    static void destroy_node(void *ptr)
+    {
+        node *n = static_cast<node *>(ptr);
+        for (int i = 0; i < n->height; ++i)
+        {
+            links(n)[i].~link_type();
+        }
+        n->~node();
+        ::operator delete(ptr);
+    }
+
+    static bool is_marked(std::uintptr_t link)
+    {
+        return (link & 1) != 0;
+    }
+
+    static node *get_node(std::uintptr_t link)
+    {
+        return reinterpret_cast<node *>(link & ~std::uintptr_t(1));
+    }
+
+    static std::uintptr_t make_link(node *n, bool marked = false)
+    {
+        return reinterpret_cast<std::uintptr_t>(n) | (marked ? 1 : 0);
+    }
+
+    static int random_level()
+    {
+        thread_local std::minstd_rand engine(std::random_device{}());
+        int level = 1;
+        while (level < max_level && (engine() & 1))
+        {
+            ++level;
+        }
+        return level;
+    }
+
+    bool equal(Key const &a, Key const &b) const
+    {
+        return !comp(a, b) && !comp(b, a);
+    }
+
+    /*
+     * 在每一层找到 key 的前驱和后继，顺路把被标记的节点摘掉
+     * preds[i] 是前驱在第 i 层的后继指针（可能是表头），succs[i] 是第 i 层第一个 key 不小于目标的节点
+     * 返回第 0 层的后继是否就是 key
+     */
+    bool find(Key const &key, link_type **preds, node **succs)
+    {
+    retry:
+        link_type *pred = head;
+        for (int level = max_level - 1; level >= 0; --level)
+        {
+            node *curr = get_node(pred[level].load(std::memory_order_acquire));
+            while (curr != nullptr)
+            {
+                std::uintptr_t succ = links(curr)[level].load(std::memory_order_acquire);
+                // curr 已被删除，从这一层摘掉它
+                while (is_marked(succ))
+                {
+                    std::uintptr_t expected = make_link(curr);
+                    if (!pred[level].compare_exchange_strong(expected, make_link(get_node(succ)),
+                                                             std::memory_order_acq_rel, std::memory_order_acquire))
+                    {
+                        goto retry;
+                    }
+                    curr = get_node(succ);
+                    if (curr == nullptr)
+                    {
+                        break;
+                    }
+                    succ = links(curr)[level].load(std::memory_order_acquire);
+                }
+                if (curr == nullptr || !comp(curr->key, key))
+                {
+                    break;
+                }
+                pred = links(curr);
+                curr = get_node(succ);
+            }
+            preds[level] = pred + level;
+            succs[level] = curr;
+        }
+        return succs[0] != nullptr && equal(succs[0]->key, key);
+    }
+
+    // 只读查找，跳过被标记的节点但不摘除，返回第 0 层第一个 key 不小于目标且未被删除的节点
+    node *lower_bound_node(Key const &key) const
+    {
+        link_type const *pred = head;
+        node *curr = nullptr;
+        for (int level = max_level - 1; level >= 0; --level)
+        {
+            curr = get_node(pred[level].load(std::memory_order_acquire));
+            while (curr != nullptr)
+            {
+                std::uintptr_t const succ = links(curr)[level].load(std::memory_order_acquire);
+                if (is_marked(succ))
+                {
+                    curr = get_node(succ);
+                    continue;
+                }
+                if (!comp(curr->key, key))
+                {
+                    break;
+                }
+                pred = links(curr);
+                curr = get_node(succ);
+            }
+        }
+        return curr;
+    }
+
+    // 第 0 层上 n 之后第一个未被删除的节点
+    static node *next_live(node *n)
+    {
+        node *curr = get_node(links(n)[0].load(std::memory_order_acquire));
+        while (curr != nullptr && is_marked(links(curr)[0].load(std::memory_order_acquire)))
+        {
+            curr = get_node(links(curr)[0].load(std::memory_order_acquire));
+        }
+        return curr;
+    }
+
+    // 链入后发现后继已被标记，需要再 find 一次把它摘掉
+    static bool succ_marked(node *succ, int level)
+    {
+        return succ != nullptr && is_marked(links(succ)[level].load(std::memory_order_acquire));
+    }
+
+    // 插入者或删除者放弃对 n 的所有权；最后一方时另一方已经做完，n 的每一层都已标记且不会再被链入，
+    // 这时 find 一次把它从所有层摘掉再退休
+    void release(epoch_participant &self, node *n)
+    {
+        if (n->owners.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        {
+            return;
+        }
+        link_type *preds[max_level];
+        node *succs[max_level];
+        find(n->key, preds, succs);
+        self.retire(n, &destroy_node);
+    }
+
+    // 表头只有后继指针数组，不存 key
+    link_type head[max_level];
+    std::atomic<std::size_t> count{0};
+    Compare comp;
+
+public:
+    explicit concurrent_skip_list_map(Compare const &comp_ = Compare()) : comp(comp_)
+    {
+        for (int i = 0; i < max_level; ++i)
+        {
+            head[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    concurrent_skip_list_map(concurrent_skip_list_map const &) = delete;
+    concurrent_skip_list_map &operator=(concurrent_skip_list_map const &) = delete;
+
+    // 析构时不应该再有其他线程访问
+    ~concurrent_skip_list_map()
+    {
+        node *curr = get_node(head[0].load(std::memory_order_relaxed));
+        while (curr != nullptr)
+        {
+            node *next = get_node(links(curr)[0].load(std::memory_order_relaxed));
+            destroy_node(curr);
+            curr = next;
+        }
+    }
+
+    // key 已存在返回 false
+    bool insert(Key const &key, Value const &value)
+    {
+        epoch_participant &self = this_thread_epoch();
+        epoch_guard guard(self);
+        link_type *preds[max_level];
+        node *succs[max_level];
+        int const height = random_level();
+        node *n = nullptr;
+        for (;;)
+        {
+            if (find(key, preds, succs))
+            {
+                if (n != nullptr)
+                {
+                    destroy_node(n);
+                }
+                return false;
+            }
+            if (n == nullptr)
+            {
+                n = create_node(key, value, height);
+            }
+            for (int i = 0; i < height; ++i)
+            {
+                links(n)[i].store(make_link(succs[i]), std::memory_order_relaxed);
+            }
+            std::uintptr_t expected = make_link(succs[0]);
+            // 第 0 层链入成功即插入生效
+            if (preds[0]->compare_exchange_strong(expected, make_link(n), std::memory_order_release, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        count.fetch_add(1, std::memory_order_relaxed);
+
+        bool need_cleanup = succ_marked(succs[0], 0);
+        for (int level = 1; level < height; ++level)
+        {
+            for (;;)
+            {
+                std::uintptr_t current = links(n)[level].load(std::memory_order_acquire);
+                if (is_marked(current))
+                {
+                    // 节点在链入上层的过程中被删除了，不再继续
+                    need_cleanup = true;
+                    goto done;
+                }
+                // 用 CAS 更新自己的后继，不能覆盖删除者打的标记
+                if (get_node(current) != succs[level] &&
+                    !links(n)[level].compare_exchange_strong(current, make_link(succs[level]), std::memory_order_release, std::memory_order_relaxed))
+                {
+                    continue;
+                }
+                std::uintptr_t expected = make_link(succs[level]);
+                if (preds[level]->compare_exchange_strong(expected, make_link(n), std::memory_order_release, std::memory_order_relaxed))
+                {
+                    if (succ_marked(succs[level], level))
+                    {
+                        need_cleanup = true;
+                    }
+                    break;
+                }
+                // 这一层的前驱变了，重新查找
+                if (!find(key, preds, succs) || succs[0] != n)
+                {
+                    need_cleanup = true;
+                    goto done;
+                }
+            }
+        }
+    done:
+        if (need_cleanup || is_marked(links(n)[0].load(std::memory_order_acquire)))
+        {
+            find(key, preds, succs);
+        }
+        release(self, n);
+        return true;
+    }
+
+    bool erase(Key const &key)
+    {
+        epoch_participant &self = this_thread_epoch();
+        epoch_guard guard(self);
+        link_type *preds[max_level];
+        node *succs[max_level];
+        if (!find(key, preds, succs))
+        {
+            return false;
+        }
+        node *victim = succs[0];
+        // 从上往下给每一层打标记
+        for (int level = victim->height - 1; level >= 1; --level)
+        {
+            std::uintptr_t succ = links(victim)[level].load(std::memory_order_acquire);
+            while (!is_marked(succ))
+            {
+                links(victim)[level].compare_exchange_weak(succ, succ | 1, std::memory_order_acq_rel, std::memory_order_acquire);
+            }
+        }
+        std::uintptr_t succ = links(victim)[0].load(std::memory_order_acquire);
+        for (;;)
+        {
+            if (is_marked(succ))
+            {
+                // 其他线程抢先删除了
+                return false;
+            }
+            if (links(victim)[0].compare_exchange_weak(succ, succ | 1, std::memory_order_acq_rel, std::memory_order_acquire))
+            {
+                break;
+            }
+        }
+        count.fetch_sub(1, std::memory_order_relaxed);
+        // 插入者还在链入上层时由它摘除和退休
+        release(self, victim);
+        return true;
+    }
+
+    bool find(Key const &key, Value &value) const
+    {
+        epoch_guard guard(this_thread_epoch());
+        node *n = lower_bound_node(key);
+        if (n == nullptr || !equal(n->key, key))
+        {
+            return false;
+        }
+        value = n->value;
+        return true;
+    }
+
+    bool contains(Key const &key) const
+    {
+        epoch_guard guard(this_thread_epoch());
+        node *n = lower_bound_node(key);
+        return n != nullptr && equal(n->key, key);
+    }
+
+    // 按顺序遍历 [lo, hi) 中的元素，弱一致：遍历期间并发插入删除的元素可能看到也可能看不到
+    template <typename Function>
+    void for_each_range(Key const &lo, Key const &hi, Function f) const
+    {
+        epoch_guard guard(this_thread_epoch());
+        for (node *n = lower_bound_node(lo); n != nullptr && comp(n->key, hi); n = next_live(n))
+        {
+            f(n->key, n->value);
+        }
+    }
+
+    template <typename Function>
+    void for_each(Function f) const
+    {
+        epoch_guard guard(this_thread_epoch());
+        node *n = get_node(head[0].load(std::memory_order_acquire));
+        if (n != nullptr && is_marked(links(n)[0].load(std::memory_order_acquire)))
+        {
+            n = next_live(n);
+        }
+        for (; n != nullptr; n = next_live(n))
+        {
+            f(n->key, n->value);
+        }
+    }
+
+    // 近似值，并发修改时可能短暂不准
+    std::size_t size() const
+    {
+        return count.load(std::memory_order_relaxed);
+    }
+};
+
+/* 有序集合，值类型为空 */
+template <typename Key, typename Compare = std::less<Key>>
+class concurrent_skip_list_set
+{
+    struct empty_value
+    {
+    };
+
+public:
+    explicit concurrent_skip_list_set(Compare const &comp = Compare()) : map(comp) {}
+
+    bool insert(Key const &key)
+    {
+        return map.insert(key, empty_value());
+    }
+
+    bool erase(Key const &key)
+    {
+        return map.erase(key);
+    }
+
+    bool contains(Key const &key) const
+    {
+        return map.contains(key);
+    }
+
+    template <typename Function>
+    void for_each_range(Key const &lo, Key const &hi, Function f) const
+    {
+        map.for_each_range(lo, hi, [&](Key const &key, empty_value const &)
+                           { f(key); });
+    }
+
+    template <typename Function>
+    void for_each(Function f) const
+    {
+        map.for_each([&](Key const &key, empty_value const &)
+                     { f(key); });
+    }
+
+    std::size_t size() const
+    {
+        return map.size();
+    }
+
+private:
+    concurrent_skip_list_map<Key, empty_value, Compare> map;
+};
+
+/* 测试：与 MultiThreadPush 相同的负载，两个线程插入，一个线程按顺序删除 */
+void TestConcurrentSkipList()
+{
+    concurrent_skip_list_set<int> set;
+
+    std::thread t1([&]()
+                   {
+        for (int i = 0; i < 20000; i++)
+        {
+            set.insert(i);
+        } });
+
+    std::thread t2([&]()
+                   {
+        for (int i = 20000; i < 40000; i++)
+        {
+            set.insert(i);
+        } });
+
+    std::thread t3([&]()
+                   {
+        for (int i = 0; i < 40000;)
+        {
+            // O(log n) 定位，不需要从头扫描
+            if (!set.erase(i))
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            i++;
+        } });
+
+    // 删除进行中的同时做范围遍历，遍历不会读到已释放的节点
+    std::thread reader([&]()
+                       {
+        for (int round = 0; round < 100; round++)
+        {
+            int last = -1;
+            bool ordered = true;
+            set.for_each_range(10000, 30000, [&](int key)
+                               {
+                if (key <= last)
+                {
+                    ordered = false;
+                }
+                last = key; });
+            if (!ordered)
+            {
+                std::cout << "range not ordered" << std::endl;
+            }
+        } });
+
+    t1.join();
+    t2.join();
+    t3.join();
+    reader.join();
+    std::cout << "skip list size after remove is " << set.size() << std::endl;
+
+    concurrent_skip_list_map<int, std::string> map;
+    for (int i = 0; i < 10; i++)
+    {
+        map.insert(i, "value " + std::to_string(i));
+    }
+    map.for_each_range(3, 6, [](int key, std::string const &value)
+                       { std::cout << "range " << key << " -> " << value << std::endl; });
+}
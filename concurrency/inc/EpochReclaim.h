@@ -0,0 +1,381 @@
+#pragma once
+
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+
+/*
+ * 基于纪元（epoch）的内存回收，适合读多写少的结构
+ * 风险指针每次解引用都要写一次风险指针并做一次 seq_cst 同步；纪元回收的读者只在进入/离开临界区时各写一次，
+ * 临界区内可以随意访问任意多个节点，读路径上没有原子读-改-写。
+ * 1. 线程先注册成 epoch_participant，访问共享结构前 pin，结束后 unpin（epoch_guard 自动完成）
+ * 2. pin 时记录当前全局纪元；只有所有 pin 住的线程都已经看到当前纪元，全局纪元才能前进一步
+ * 3. 在纪元 e 退休的节点，等全局纪元到达 e + 2 时，所有可能看到它的读者都已经离开临界区，可以安全释放
+ * 4. 一个线程 pin 住后长时间不动会卡住纪元，导致所有退休节点都无法释放。每个线程退休未释放的节点数有上限，
+ *    超过上限且自己没有 pin 住时，退休线程会等待纪元前进，用写者的延迟换取内存有界；
+ *    pin 住时不能等待（会等自己），此时上限是软限制
+ */
+class epoch_domain
+{
+public:
+    struct retired_item
+    {
+        void *ptr;
+        void (*deleter)(void *);
+        std::uint64_t epoch;
+    };
+
+    // 每个注册线程一条记录，对齐到缓存行
+    struct alignas(64) participant_record
+    {
+        // 最低位表示是否 pin 住，其余位为 pin 时看到的纪元
+        std::atomic<std::uint64_t> state{0};
+        std::atomic<bool> in_use{false};
+        participant_record *next = nullptr;
+        // 以下成员只由所属线程访问
+        unsigned nest = 0;
+        std::vector<retired_item> bag;
+        std::size_t retired_since_collect = 0;
+    };
+
+    explicit epoch_domain(std::size_t max_retired_per_thread_ = 4096)
+        : max_retired_per_thread(max_retired_per_thread_)
+    {
+    }
+
+    epoch_domain(epoch_domain const &) = delete;
+    epoch_domain &operator=(epoch_domain const &) = delete;
+
+    // 析构时不应该再有注册的线程
+    ~epoch_domain()
+    {
+        for (retired_item const &item : orphans)
+        {
+            item.deleter(item.ptr);
+        }
+        participant_record *record = records.load(std::memory_order_acquire);
+        while (record != nullptr)
+        {
+            participant_record *next = record->next;
+            delete record;
+            record = next;
+        }
+    }
+
+    // 全局默认域，故意不析构
+    static epoch_domain &global()
+    {
+        static epoch_domain *domain = new epoch_domain;
+        return *domain;
+    }
+
+    std::uint64_t epoch() const
+    {
+        return global_epoch.load(std::memory_order_acquire);
+    }
+
+    // 所有 pin 住的线程都看到了当前纪元时，把全局纪元加一
+    bool try_advance()
+    {
+        std::uint64_t const current = global_epoch.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (participant_record *record = records.load(std::memory_order_acquire); record != nullptr; record = record->next)
+        {
+            std::uint64_t const state = record->state.load(std::memory_order_acquire);
+            if ((state & 1) && (state >> 1) != current)
+            {
+                return false;
+            }
+        }
+        std::uint64_t expected = current;
+        global_epoch.compare_exchange_strong(expected, current + 1, std::memory_order_acq_rel);
+        collect_orphans();
+        return true;
+    }
+
+    // 所有线程退休但尚未释放的节点数
+    std::size_t pending() const
+    {
+        return pending_count.load(std::memory_order_relaxed);
+    }
+
+    // pin 住且落后于全局纪元的线程数，长期不为 0 说明有线程卡在临界区里
+    std::size_t stalled() const
+    {
+        std::uint64_t const current = global_epoch.load(std::memory_order_acquire);
+        std::size_t count = 0;
+        for (participant_record *record = records.load(std::memory_order_acquire); record != nullptr; record = record->next)
+        {
+            std::uint64_t const state = record->state.load(std::memory_order_relaxed);
+            if ((state & 1) && (state >> 1) != current)
+            {
+                ++count;
+            }
+        }
+        return count;
+    }
+
+private:
+    friend class epoch_participant;
+
+    participant_record *acquire_record()
+    {
+        for (participant_record *record = records.load(std::memory_order_acquire); record != nullptr; record = record->next)
+        {
+            if (!record->in_use.load(std::memory_order_relaxed) &&
+                !record->in_use.exchange(true, std::memory_order_acquire))
+            {
+                return record;
+            }
+        }
+        participant_record *record = new participant_record;
+        record->in_use.store(true, std::memory_order_relaxed);
+        participant_record *old_head = records.load(std::memory_order_relaxed);
+        do
+        {
+            record->next = old_head;
+        } while (!records.compare_exchange_weak(old_head, record, std::memory_order_release, std::memory_order_relaxed));
+        return record;
+    }
+
+    // 线程注销时还没释放的节点交给域统一管理
+    void release_record(participant_record *record)
+    {
+        if (!record->bag.empty())
+        {
+            std::lock_guard<std::mutex> lock(orphans_mutex);
+            orphans.insert(orphans.end(), record->bag.begin(), record->bag.end());
+            record->bag.clear();
+        }
+        record->state.store(0, std::memory_order_release);
+        record->in_use.store(false, std::memory_order_release);
+    }
+
+    // 释放 items 中已经安全的节点，返回释放的个数
+    std::size_t free_safe(std::vector<retired_item> &items)
+    {
+        std::uint64_t const current = global_epoch.load(std::memory_order_acquire);
+        auto safe_begin = std::partition(items.begin(), items.end(), [current](retired_item const &item)
+                                         { return item.epoch + 2 > current; });
+        std::size_t const freed = items.end() - safe_begin;
+        for (auto it = safe_begin; it != items.end(); ++it)
+        {
+            it->deleter(it->ptr);
+        }
+        items.erase(safe_begin, items.end());
+        pending_count.fetch_sub(freed, std::memory_order_relaxed);
+        return freed;
+    }
+
+    void collect_orphans()
+    {
+        std::unique_lock<std::mutex> lock(orphans_mutex, std::try_to_lock);
+        if (lock.owns_lock() && !orphans.empty())
+        {
+            free_safe(orphans);
+        }
+    }
+
+    std::size_t const max_retired_per_thread;
+    std::atomic<std::uint64_t> global_epoch{0};
+    std::atomic<participant_record *> records{nullptr};
+    std::atomic<std::size_t> pending_count{0};
+    std::mutex orphans_mutex;
+    std::vector<retired_item> orphans;
+};
+
+/* 线程在域中的注册句柄，只能由创建它的线程使用 */
+class epoch_participant
+{
+public:
+    explicit epoch_participant(epoch_domain &domain_ = epoch_domain::global())
+        : domain(domain_), record(domain_.acquire_record())
+    {
+    }
+
+    ~epoch_participant()
+    {
+        collect();
+        domain.release_record(record);
+    }
+
+    epoch_participant(epoch_participant const &) = delete;
+    epoch_participant &operator=(epoch_participant const &) = delete;
+
+    // 进入临界区，可以嵌套
+    void pin()
+    {
+        if (record->nest++ == 0)
+        {
+            std::uint64_t const current = domain.global_epoch.load(std::memory_order_relaxed);
+            record->state.store((current << 1) | 1, std::memory_order_relaxed);
+            // 保证之后对共享结构的读取不会被重排到发布纪元之前
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+
+    void unpin()
+    {
+        if (--record->nest == 0)
+        {
+            record->state.store(0, std::memory_order_release);
+        }
+    }
+
+    bool pinned() const
+    {
+        return record->nest != 0;
+    }
+
+    // 延迟释放 ptr，调用前 ptr 必须已经从共享结构中摘下
+    void retire(void *ptr, void (*deleter)(void *))
+    {
+        record->bag.push_back(epoch_domain::retired_item{ptr, deleter, domain.global_epoch.load(std::memory_order_acquire)});
+        domain.pending_count.fetch_add(1, std::memory_order_relaxed);
+        // 攒一批再尝试前进纪元和回收，避免每次退休都扫描所有线程
+        if (++record->retired_since_collect >= collect_batch)
+        {
+            collect();
+        }
+        if (record->bag.size() > domain.max_retired_per_thread && !pinned())
+        {
+            // 超过上限，等待卡住纪元的线程离开临界区
+            while (record->bag.size() > domain.max_retired_per_thread)
+            {
+                std::this_thread::yield();
+                collect();
+            }
+        }
+    }
+
+    template <typename T>
+    void retire(T *ptr)
+    {
+        retire(ptr, [](void *p)
+               { delete static_cast<T *>(p); });
+    }
+
+    // 尝试前进纪元并释放自己退休列表中已经安全的节点
+    std::size_t collect()
+    {
+        record->retired_since_collect = 0;
+        domain.try_advance();
+        return domain.free_safe(record->bag);
+    }
+
+private:
+    static constexpr std::size_t collect_batch = 64;
+
+    epoch_domain &domain;
+    epoch_domain::participant_record *record;
+};
+
+// 当前线程在全局域中的注册句柄，第一次使用时注册，线程退出时自动注销
+inline epoch_participant &this_thread_epoch()
+{
+    thread_local epoch_participant participant(epoch_domain::global());
+    return participant;
+}
+
+/* RAII 临界区 */
+class epoch_guard
+{
+public:
+    explicit epoch_guard(epoch_participant &participant_) : participant(participant_)
+    {
+        participant.pin();
+    }
+
+    ~epoch_guard()
+    {
+        participant.unpin();
+    }
+
+    epoch_guard(epoch_guard const &) = delete;
+    epoch_guard &operator=(epoch_guard const &) = delete;
+
+private:
+    epoch_participant &participant;
+};
+
+/* 测试：读者在临界区内反复读取共享配置，写者不断替换配置并退休旧配置 */
+namespace epoch_test
+{
+    std::atomic<long> live_configs{0};
+
+    struct config
+    {
+        long version;
+        long checksum;
+        explicit config(long v) : version(v), checksum(v * 7) { live_configs++; }
+        ~config()
+        {
+            // 释放后校验和会对不上，读者借此发现提前释放
+            checksum = -1;
+            live_configs--;
+        }
+    };
+}
+
+void TestEpochReclaim()
+{
+    {
+        epoch_domain domain(1024);
+        std::atomic<epoch_test::config *> current{new epoch_test::config(0)};
+        std::atomic<bool> done{false};
+        std::atomic<long> bad{0};
+
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 4; t++)
+        {
+            readers.emplace_back([&]()
+                                 {
+                epoch_participant self(domain);
+                while (!done)
+                {
+                    epoch_guard guard(self);
+                    // 临界区内的读取不需要任何原子读-改-写
+                    epoch_test::config *cfg = current.load(std::memory_order_acquire);
+                    if (cfg->checksum != cfg->version * 7)
+                    {
+                        bad++;
+                    }
+                } });
+        }
+
+        // 一个卡住的读者，pin 住 200 毫秒不动
+        std::thread stalled([&]()
+                            {
+            epoch_participant self(domain);
+            epoch_guard guard(self);
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            });
+
+        std::size_t max_pending = 0;
+        {
+            epoch_participant self(domain);
+            for (long v = 1; v <= 20000; v++)
+            {
+                epoch_test::config *old_cfg = current.exchange(new epoch_test::config(v), std::memory_order_acq_rel);
+                self.retire(old_cfg);
+                max_pending = std::max(max_pending, domain.pending());
+            }
+            done = true;
+        }
+
+        for (auto &th : readers)
+        {
+            th.join();
+        }
+        stalled.join();
+        std::cout << "freed too early " << bad << ", max pending " << max_pending
+                  << ", stalled now " << domain.stalled() << std::endl;
+        delete current.load();
+    }
+    std::cout << "live configs after domain destroyed " << epoch_test::live_configs << std::endl;
+}
@@ -0,0 +1,403 @@
+#pragma once
+
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cstddef>
+#include <mutex>
+
+/*
+ * 风险指针（hazard pointer）内存回收
+ * 无锁结构中一个线程摘下节点后不能立即 delete，因为别的线程可能刚读到这个节点的指针还没来得及用。
+ * 1. 读者访问节点前，把节点地址写进自己的风险指针，再确认源指针没变，这之后节点保证不会被释放
+ * 2. 摘下节点的线程调用 retire 把节点放进待回收链表，而不是直接 delete
+ * 3. 待回收的节点数超过阈值时批量扫描：收集所有线程当前的风险指针，没有被任何风险指针指向的节点才释放
+ * 阈值与风险指针的数量成正比，所以扫描的均摊代价是常数，未回收的节点数也有上界
+ *
+ * 风险指针记录不与线程绑定，每个 hazard_pointer 对象构造时从域中借一个空闲记录，析构时归还，
+ * 不依赖 thread_local，线程退出也不会留下悬空的记录
+ */
+class hazard_domain
+{
+public:
+    // 每条记录只保存一个风险指针，对齐到缓存行，避免读者之间伪共享
+    struct alignas(64) hazard_record
+    {
+        std::atomic<void const *> ptr{nullptr};
+        std::atomic<bool> active{false};
+        hazard_record *next = nullptr;
+    };
+
+    hazard_domain() {}
+
+    hazard_domain(hazard_domain const &) = delete;
+    hazard_domain &operator=(hazard_domain const &) = delete;
+
+    // 析构时不应该再有任何线程持有风险指针
+    ~hazard_domain()
+    {
+        retired_node *node = retired.exchange(nullptr, std::memory_order_acquire);
+        while (node != nullptr)
+        {
+            retired_node *next = node->next;
+            node->deleter(node->ptr);
+            delete node;
+            node = next;
+        }
+        hazard_record *record = records.load(std::memory_order_acquire);
+        while (record != nullptr)
+        {
+            hazard_record *next = record->next;
+            delete record;
+            record = next;
+        }
+    }
+
+    // 全局默认域，故意不析构，避免进程退出时与仍在运行的线程竞争
+    static hazard_domain &global()
+    {
+        static hazard_domain *domain = new hazard_domain;
+        return *domain;
+    }
+
+    // 借一条空闲记录，没有空闲的就新建一条挂到链表头，记录只增不减
+    hazard_record *acquire_record()
+    {
+        for (hazard_record *record = records.load(std::memory_order_acquire); record != nullptr; record = record->next)
+        {
+            if (!record->active.load(std::memory_order_relaxed) &&
+                !record->active.exchange(true, std::memory_order_acquire))
+            {
+                return record;
+            }
+        }
+        hazard_record *record = new hazard_record;
+        record->active.store(true, std::memory_order_relaxed);
+        hazard_record *old_head = records.load(std::memory_order_relaxed);
+        do
+        {
+            record->next = old_head;
+        } while (!records.compare_exchange_weak(old_head, record, std::memory_order_release, std::memory_order_relaxed));
+        record_count.fetch_add(1, std::memory_order_relaxed);
+        return record;
+    }
+
+    void release_record(hazard_record *record)
+    {
+        record->ptr.store(nullptr, std::memory_order_release);
+        record->active.store(false, std::memory_order_release);
+    }
+
+    // 延迟释放 ptr，待回收数达到阈值时触发一次扫描
+    void retire(void *ptr, void (*deleter)(void *))
+    {
+        retired_node *node = new retired_node{ptr, deleter, nullptr};
+        push_retired(node, node);
+        if (retired_count.fetch_add(1, std::memory_order_relaxed) + 1 >= scan_threshold())
+        {
+            scan();
+        }
+    }
+
+    // 立即扫描一次，释放所有没有被保护的节点，返回释放的个数
+    std::size_t reclaim()
+    {
+        return scan();
+    }
+
+    // 当前尚未释放的节点数
+    std::size_t pending() const
+    {
+        return retired_count.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct retired_node
+    {
+        void *ptr;
+        void (*deleter)(void *);
+        retired_node *next;
+    };
+
+    // 至少攒够这么多再扫描，避免风险指针少的时候频繁扫描
+    static constexpr std::size_t min_batch = 64;
+
+    std::size_t scan_threshold() const
+    {
+        return std::max(min_batch, 2 * record_count.load(std::memory_order_relaxed));
+    }
+
+    // 把 first 到 last 这一段链表整体压入待回收链表
+    void push_retired(retired_node *first, retired_node *last)
+    {
+        retired_node *old_head = retired.load(std::memory_order_relaxed);
+        do
+        {
+            last->next = old_head;
+        } while (!retired.compare_exchange_weak(old_head, first, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    std::size_t scan()
+    {
+        // 一次性取走整个待回收链表，多个线程同时扫描时各自处理各自取到的部分
+        retired_node *list = retired.exchange(nullptr, std::memory_order_acquire);
+        if (list == nullptr)
+        {
+            return 0;
+        }
+        // 与 protect 中的 seq_cst 写配对：节点在 retire 之前已经从结构中摘下，
+        // 如果读者的风险指针写在这之后才可见，那它重新读源指针时一定发现节点已经不在了
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::vector<void const *> hazards;
+        for (hazard_record *record = records.load(std::memory_order_acquire); record != nullptr; record = record->next)
+        {
+            void const *ptr = record->ptr.load(std::memory_order_acquire);
+            if (ptr != nullptr)
+            {
+                hazards.push_back(ptr);
+            }
+        }
+        std::sort(hazards.begin(), hazards.end());
+
+        std::size_t reclaimed = 0;
+        retired_node *keep_first = nullptr;
+        retired_node *keep_last = nullptr;
+        while (list != nullptr)
+        {
+            retired_node *next = list->next;
+            if (std::binary_search(hazards.begin(), hazards.end(), static_cast<void const *>(list->ptr)))
+            {
+                // 仍然被保护，留到下次扫描
+                list->next = keep_first;
+                keep_first = list;
+                if (keep_last == nullptr)
+                {
+                    keep_last = list;
+                }
+            }
+            else
+            {
+                list->deleter(list->ptr);
+                delete list;
+                ++reclaimed;
+            }
+            list = next;
+        }
+        if (keep_first != nullptr)
+        {
+            push_retired(keep_first, keep_last);
+        }
+        retired_count.fetch_sub(reclaimed, std::memory_order_relaxed);
+        return reclaimed;
+    }
+
+    std::atomic<hazard_record *> records{nullptr};
+    std::atomic<std::size_t> record_count{0};
+    std::atomic<retired_node *> retired{nullptr};
+    std::atomic<std::size_t> retired_count{0};
+};
+
+/* 风险指针对象，RAII 管理一条记录 */
+class hazard_pointer
+{
+public:
+    explicit hazard_pointer(hazard_domain &domain_ = hazard_domain::global())
+        : domain(domain_), record(domain_.acquire_record())
+    {
+    }
+
+    ~hazard_pointer()
+    {
+        domain.release_record(record);
+    }
+
+    hazard_pointer(hazard_pointer const &) = delete;
+    hazard_pointer &operator=(hazard_pointer const &) = delete;
+
+    // 保护 src 当前指向的对象并返回它，返回后直到下次 protect/reset 之前对象都不会被释放
+    template <typename T>
+    T *protect(std::atomic<T *> const &src)
+    {
+        T *ptr = src.load(std::memory_order_relaxed);
+        while (!try_protect(ptr, src))
+        {
+        }
+        return ptr;
+    }
+
+    // 把 ptr 写入风险指针后确认 src 仍然指向 ptr，不一致时 ptr 更新为 src 的新值并返回 false
+    template <typename T>
+    bool try_protect(T *&ptr, std::atomic<T *> const &src)
+    {
+        T *const expected = ptr;
+        record->ptr.store(expected, std::memory_order_seq_cst);
+        ptr = src.load(std::memory_order_seq_cst);
+        if (ptr != expected)
+        {
+            record->ptr.store(nullptr, std::memory_order_release);
+            return false;
+        }
+        return true;
+    }
+
+    // 直接设置保护的指针，调用方需自己保证设置时对象仍然有效
+    template <typename T>
+    void reset_protection(T const *ptr)
+    {
+        record->ptr.store(ptr, std::memory_order_seq_cst);
+    }
+
+    void reset_protection()
+    {
+        record->ptr.store(nullptr, std::memory_order_release);
+    }
+
+private:
+    hazard_domain &domain;
+    hazard_domain::hazard_record *record;
+};
+
+// 延迟 delete ptr，直到没有风险指针指向它
+template <typename T>
+void hazard_retire(T *ptr, hazard_domain &domain = hazard_domain::global())
+{
+    domain.retire(ptr, [](void *p)
+                  { delete static_cast<T *>(p); });
+}
+
+/* 测试：用风险指针回收节点的 Treiber 栈，多线程反复 push/pop，检查节点全部被释放且没有提前释放 */
+namespace hazard_test
+{
+    std::atomic<long> live_nodes{0};
+    // 在风险指针保护下读到已回收节点的次数
+    std::atomic<long> early_reads{0};
+
+    struct node
+    {
+        int value;
+        node *next;
+        // 回收时把 value 和 next 都改成毒值，受保护的读者读到毒值说明节点被提前回收了
+        static constexpr int poisoned_value = -1;
+        static node *poisoned_next()
+        {
+            return reinterpret_cast<node *>(alignof(node));
+        }
+
+        explicit node(int v) : value(v), next(nullptr) { live_nodes++; }
+        ~node()
+        {
+            value = poisoned_value;
+            next = poisoned_next();
+            live_nodes--;
+        }
+    };
+
+    // 回收时只析构打上毒值，内存放进隔离区到测试结束才释放，否则分配器复用这块内存时会覆盖毒值
+    std::mutex quarantine_mutex;
+    std::vector<void *> quarantine;
+
+    void reclaim_node(void *ptr)
+    {
+        static_cast<node *>(ptr)->~node();
+        std::lock_guard<std::mutex> lock(quarantine_mutex);
+        quarantine.push_back(ptr);
+    }
+
+    void release_quarantine()
+    {
+        std::lock_guard<std::mutex> lock(quarantine_mutex);
+        for (void *ptr : quarantine)
+        {
+            ::operator delete(ptr);
+        }
+        quarantine.clear();
+    }
+
+    struct stack
+    {
+        std::atomic<node *> head{nullptr};
+        hazard_domain &domain;
+
+        explicit stack(hazard_domain &d) : domain(d) {}
+
+        void push(int value)
+        {
+            node *n = new node(value);
+            n->next = head.load(std::memory_order_relaxed);
+            while (!head.compare_exchange_weak(n->next, n, std::memory_order_release, std::memory_order_relaxed))
+            {
+            }
+        }
+
+        bool pop(int &value)
+        {
+            hazard_pointer hp(domain);
+            node *old_head = hp.protect(head);
+            while (old_head != nullptr)
+            {
+                // 受保护后读取节点是安全的，这时其他线程可能已经把它摘下并退休，但不能已经回收
+                node *const next = old_head->next;
+                int const v = old_head->value;
+                if (v == node::poisoned_value || next == node::poisoned_next())
+                {
+                    early_reads++;
+                }
+                if (head.compare_exchange_strong(old_head, next, std::memory_order_acquire, std::memory_order_relaxed))
+                {
+                    value = v;
+                    break;
+                }
+                old_head = hp.protect(head);
+            }
+            hp.reset_protection();
+            if (old_head == nullptr)
+            {
+                return false;
+            }
+            domain.retire(old_head, &reclaim_node);
+            return true;
+        }
+    };
+}
+
+void TestHazardPointer()
+{
+    {
+        hazard_domain domain;
+        hazard_test::stack stack(domain);
+        std::atomic<long> pop_sum{0};
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 16; t++)
+        {
+            threads.emplace_back([&, t]()
+                                 {
+                for (int i = 1; i <= 20000; i++)
+                {
+                    stack.push(t * 20000 + i);
+                    int value;
+                    if (stack.pop(value))
+                    {
+                        pop_sum += value;
+                    }
+                } });
+        }
+        for (auto &th : threads)
+        {
+            th.join();
+        }
+        int value;
+        while (stack.pop(value))
+        {
+            pop_sum += value;
+        }
+        std::cout << "pop sum is " << pop_sum << ", expected " << 320000L * 320001 / 2
+                  << ", freed too early " << hazard_test::early_reads << std::endl;
+        std::cout << "pending before reclaim " << domain.pending();
+        domain.reclaim();
+        std::cout << ", after reclaim " << domain.pending() << std::endl;
+    }
+    hazard_test::release_quarantine();
+    std::cout << "live nodes after domain destroyed " << hazard_test::live_nodes << std::endl;
+}
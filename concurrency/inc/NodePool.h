@@ -0,0 +1,233 @@
+#pragma once
+
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <mutex>
+#include <new>
+#include <cstddef>
+#include <algorithm>
+
+/*
+ * 按线程缓存的定长节点池，给链表这类频繁 new/delete 同一种节点的结构使用
+ * 1. 每个线程有自己的空闲链表，分配和释放都只操作本线程的链表，不加锁也不访问全局堆
+ * 2. 本线程空闲链表为空时，先从全局仓库取一批，仓库也空了才向系统申请一整块 slab，切成 slab_nodes 个节点
+ * 3. 释放的节点放回当前线程（不一定是分配它的线程）的空闲链表，攒得太多时成批还给全局仓库，
+ *    这样一个线程只 push、另一个线程只 remove 时，节点可以经由仓库流回生产者，不会无限增长
+ * 4. 线程退出时把剩余的空闲节点还给仓库；slab 本身只增不减，直到进程退出
+ * 用法：在节点类型中重载 operator new/delete，转调 node_pool<Node>::allocate/deallocate
+ */
+template <typename Node>
+class node_pool
+{
+public:
+    static void *allocate()
+    {
+        local_cache &cache = local();
+        if (cache.head == nullptr)
+        {
+            instance().refill(cache);
+        }
+        free_node *n = cache.head;
+        cache.head = n->next;
+        --cache.count;
+        return n;
+    }
+
+    static void deallocate(void *ptr)
+    {
+        if (ptr == nullptr)
+        {
+            return;
+        }
+        local_cache &cache = local();
+        free_node *n = static_cast<free_node *>(ptr);
+        n->next = cache.head;
+        cache.head = n;
+        if (++cache.count > max_local)
+        {
+            instance().spill(cache, batch_nodes);
+        }
+    }
+
+    // 已经向系统申请的 slab 个数
+    static std::size_t slab_count()
+    {
+        node_pool &pool = instance();
+        std::lock_guard<std::mutex> lock(pool.depot_mutex);
+        return pool.slabs.size();
+    }
+
+private:
+    struct free_node
+    {
+        free_node *next;
+    };
+
+    static constexpr std::size_t node_align = std::max(alignof(Node), alignof(free_node));
+    // 节点大小向上取整到对齐值，保证 slab 中每个节点都是对齐的
+    static constexpr std::size_t node_size =
+        (std::max(sizeof(Node), sizeof(free_node)) + node_align - 1) / node_align * node_align;
+    static constexpr std::size_t slab_nodes = 64;
+    static constexpr std::size_t batch_nodes = 64;
+    static constexpr std::size_t max_local = 2 * batch_nodes;
+
+    // 一批空闲节点组成的链表
+    struct batch
+    {
+        free_node *head;
+        std::size_t count;
+    };
+
+    struct local_cache
+    {
+        free_node *head = nullptr;
+        std::size_t count = 0;
+
+        ~local_cache()
+        {
+            if (count != 0)
+            {
+                instance().spill(*this, count);
+            }
+        }
+    };
+
+    // 仓库故意不析构，线程的 thread_local 缓存在进程退出时析构，仍然要用到仓库
+    static node_pool &instance()
+    {
+        static node_pool *pool = new node_pool;
+        return *pool;
+    }
+
+    static local_cache &local()
+    {
+        thread_local local_cache cache;
+        return cache;
+    }
+
+    // 本线程缓存为空，从仓库取一批，仓库为空就申请新的 slab
+    void refill(local_cache &cache)
+    {
+        std::lock_guard<std::mutex> lock(depot_mutex);
+        if (!depot.empty())
+        {
+            batch b = depot.back();
+            depot.pop_back();
+            cache.head = b.head;
+            cache.count = b.count;
+            return;
+        }
+        char *slab = static_cast<char *>(::operator new(node_size * slab_nodes, std::align_val_t(node_align)));
+        slabs.push_back(slab);
+        for (std::size_t i = slab_nodes; i > 0; --i)
+        {
+            free_node *n = reinterpret_cast<free_node *>(slab + (i - 1) * node_size);
+            n->next = cache.head;
+            cache.head = n;
+        }
+        cache.count = slab_nodes;
+    }
+
+    // 从本线程缓存摘下 count 个节点还给仓库
+    void spill(local_cache &cache, std::size_t count)
+    {
+        batch b{cache.head, count};
+        free_node *tail = cache.head;
+        for (std::size_t i = 1; i < count; ++i)
+        {
+            tail = tail->next;
+        }
+        cache.head = tail->next;
+        cache.count -= count;
+        tail->next = nullptr;
+        std::lock_guard<std::mutex> lock(depot_mutex);
+        depot.push_back(b);
+    }
+
+    std::mutex depot_mutex;
+    std::vector<batch> depot;
+    std::vector<char *> slabs;
+};
+
+/*
+ * 把 node_pool 包装成标准分配器，给 std::allocate_shared 这类需要分配器的接口使用，
+ * 单个对象从对应类型的节点池分配，数组仍然走全局堆
+ */
+template <typename T>
+class node_pool_allocator
+{
+public:
+    typedef T value_type;
+
+    node_pool_allocator() = default;
+
+    template <typename U>
+    node_pool_allocator(node_pool_allocator<U> const &)
+    {
+    }
+
+    T *allocate(std::size_t n)
+    {
+        if (n == 1)
+        {
+            return static_cast<T *>(node_pool<T>::allocate());
+        }
+        return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+    }
+
+    void deallocate(T *ptr, std::size_t n)
+    {
+        if (n == 1)
+        {
+            node_pool<T>::deallocate(ptr);
+            return;
+        }
+        ::operator delete(ptr, std::align_val_t(alignof(T)));
+    }
+
+    template <typename U>
+    bool operator==(node_pool_allocator<U> const &) const
+    {
+        return true;
+    }
+
+    template <typename U>
+    bool operator!=(node_pool_allocator<U> const &) const
+    {
+        return false;
+    }
+};
+
+/* 测试：一个线程只分配，另一个线程只释放，节点经由仓库流回，slab 数量保持稳定 */
+void TestNodePool()
+{
+    struct test_node
+    {
+        long value[4];
+    };
+    typedef node_pool<test_node> pool;
+
+    for (int round = 0; round < 10; round++)
+    {
+        std::vector<void *> nodes;
+        std::mutex mtx;
+        std::thread producer([&]()
+                             {
+            for (int i = 0; i < 10000; i++)
+            {
+                void *p = pool::allocate();
+                std::lock_guard<std::mutex> lock(mtx);
+                nodes.push_back(p);
+            } });
+        producer.join();
+        std::thread consumer([&]()
+                             {
+            for (void *p : nodes)
+            {
+                pool::deallocate(p);
+            } });
+        consumer.join();
+        std::cout << "round " << round << " slab count is " << pool::slab_count() << std::endl;
+    }
+}
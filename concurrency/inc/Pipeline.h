@@ -0,0 +1,441 @@
+#pragma once
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <vector>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <type_traits>
+#include <cstdint>
+#include "CSP.h"
+#include "ThreadPool.h"
+
+/*
+ * 带背压的流水线
+ *   auto job = make_pipeline<int>("source", [](auto &emit) { for (int i = 0; i < n; ++i) if (!emit(i)) break; })
+ *                  .map("square", [](int x) { return x * x; }, 4)
+ *                  .filter("even", [](int x) { return x % 2 == 0; })
+ *                  .sink("sum", [&](int x) { sum += x; });
+ *   job.run();
+ *   job.print_stats(std::cout);
+ * 1. 相邻阶段之间是有界 Channel，下游处理不过来时上游 send 阻塞，背压一直传到源头
+ * 2. 每个阶段可以有多个并行的工作者，并行时不保证顺序；工作者批量接收，一批只做一次同步
+ * 3. 一个阶段的所有工作者都结束后关闭它的输出通道，关闭逐级传到 sink，整条流水线自然结束；
+ *    cancel 关闭所有通道，下游提前退出时也会关闭自己的输入，让上游停下来
+ * 4. 每个阶段统计输入/输出个数、忙碌时间和输入队列的平均占用率：
+ *    瓶颈阶段的利用率接近 100%，它的输入队列接近满，而它的输出队列接近空
+ * 工作者会阻塞在通道上，线程池的空闲线程不够时，剩下的工作者用独立线程运行，避免占满线程池互相等待
+ */
+struct pipeline_stage_stats
+{
+    std::string name;
+    unsigned parallelism = 1;
+    std::size_t capacity = 0; // 输入通道容量，源头为 0
+    std::atomic<std::uint64_t> items_in{0};
+    std::atomic<std::uint64_t> items_out{0};
+    std::atomic<std::uint64_t> busy_ns{0};
+    std::atomic<std::uint64_t> occupancy_sum{0};
+    std::atomic<std::uint64_t> occupancy_samples{0};
+};
+
+// 把阶段产生的元素发送到下游，下游已关闭时返回 false
+template <typename T>
+class pipeline_emitter
+{
+public:
+    explicit pipeline_emitter(Channel<T> &out_) : out(out_) {}
+
+    bool operator()(T value)
+    {
+        if (closed)
+        {
+            return false;
+        }
+        if (!out.send(std::move(value)))
+        {
+            closed = true;
+            return false;
+        }
+        ++emitted;
+        return true;
+    }
+
+    bool downstream_closed() const
+    {
+        return closed;
+    }
+
+    // 取出并清零本批发送的个数，统计按批更新，避免每个元素一次原子操作
+    std::uint64_t take_emitted()
+    {
+        std::uint64_t const n = emitted;
+        emitted = 0;
+        return n;
+    }
+
+private:
+    Channel<T> &out;
+    bool closed = false;
+    std::uint64_t emitted = 0;
+};
+
+// 一条流水线的所有工作者、通道和统计，由各阶段的构建器共享
+class pipeline_graph
+{
+public:
+    std::vector<std::function<void()>> workers;
+    std::vector<std::function<void()>> closers;
+    std::vector<std::unique_ptr<pipeline_stage_stats>> stages;
+    std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::time_point finished;
+    bool running = false;
+
+    pipeline_stage_stats *add_stage(std::string name, unsigned parallelism, std::size_t capacity)
+    {
+        stages.emplace_back(new pipeline_stage_stats);
+        pipeline_stage_stats *stats = stages.back().get();
+        stats->name = std::move(name);
+        stats->parallelism = parallelism;
+        stats->capacity = capacity;
+        return stats;
+    }
+
+    template <typename T>
+    std::shared_ptr<Channel<T>> add_channel(std::size_t capacity)
+    {
+        std::shared_ptr<Channel<T>> ch = std::make_shared<Channel<T>>(capacity);
+        closers.push_back([ch]()
+                          { ch->close(); });
+        return ch;
+    }
+};
+
+class pipeline_job;
+
+template <typename T>
+class pipeline
+{
+public:
+    pipeline(std::shared_ptr<pipeline_graph> graph_, std::shared_ptr<Channel<T>> output_)
+        : graph(std::move(graph_)), output(std::move(output_))
+    {
+    }
+
+    // 一对一变换
+    template <typename Fn, typename U = std::decay_t<std::invoke_result_t<Fn &, T>>>
+    pipeline<U> map(std::string name, Fn fn, unsigned parallelism = 1, std::size_t capacity = default_capacity)
+    {
+        return add_stage<U>(std::move(name), parallelism, capacity, [fn](T &&item, pipeline_emitter<U> &emit) mutable
+                            { emit(fn(std::move(item))); });
+    }
+
+    // 只保留满足条件的元素
+    template <typename Pred>
+    pipeline<T> filter(std::string name, Pred pred, unsigned parallelism = 1, std::size_t capacity = default_capacity)
+    {
+        return add_stage<T>(std::move(name), parallelism, capacity, [pred](T &&item, pipeline_emitter<T> &emit) mutable
+                            {
+            if (pred(static_cast<T const &>(item)))
+            {
+                emit(std::move(item));
+            } });
+    }
+
+    // 一个元素产生零个或多个元素：fn(item, emit)，emit(value) 返回 false 表示下游已关闭
+    template <typename U, typename Fn>
+    pipeline<U> flat_map(std::string name, Fn fn, unsigned parallelism = 1, std::size_t capacity = default_capacity)
+    {
+        return add_stage<U>(std::move(name), parallelism, capacity, [fn](T &&item, pipeline_emitter<U> &emit) mutable
+                            { fn(std::move(item), emit); });
+    }
+
+    // 终点，返回还没有启动的流水线
+    template <typename Fn>
+    pipeline_job sink(std::string name, Fn fn, unsigned parallelism = 1);
+
+    static constexpr std::size_t default_capacity = 64;
+    static constexpr std::size_t batch_size = 32;
+
+private:
+    template <typename U>
+    friend class pipeline;
+
+    // 添加一个从 output 读、向新通道写的阶段，body(item, emit) 处理一个元素
+    template <typename U, typename Body>
+    pipeline<U> add_stage(std::string name, unsigned parallelism, std::size_t capacity, Body body)
+    {
+        parallelism = std::max(1u, parallelism);
+        pipeline_stage_stats *stats = graph->add_stage(std::move(name), parallelism, output->capacity());
+        std::shared_ptr<Channel<U>> next = graph->template add_channel<U>(capacity);
+        std::shared_ptr<std::atomic<unsigned>> remaining = std::make_shared<std::atomic<unsigned>>(parallelism);
+        std::shared_ptr<Channel<T>> in = output;
+        for (unsigned i = 0; i < parallelism; ++i)
+        {
+            graph->workers.push_back([in, next, stats, remaining, body]() mutable
+                                     {
+                pipeline_emitter<U> emit(*next);
+                drain(*in, *stats, [&](T &&item)
+                      {
+                    body(std::move(item), emit);
+                    return !emit.downstream_closed(); }, [&]()
+                      { stats->items_out.fetch_add(emit.take_emitted(), std::memory_order_relaxed); });
+                // 最后一个结束的工作者关闭输出通道
+                if (remaining->fetch_sub(1, std::memory_order_acq_rel) == 1)
+                {
+                    next->close();
+                } });
+        }
+        return pipeline<U>(graph, next);
+    }
+
+    // 批量接收 in 中的元素交给 handle，handle 返回 false 表示下游已关闭，此时关闭 in 让上游停下来
+    template <typename Handle, typename Flush>
+    static void drain(Channel<T> &in, pipeline_stage_stats &stats, Handle handle, Flush flush)
+    {
+        std::vector<T> batch;
+        batch.reserve(batch_size);
+        bool open = true;
+        while (open)
+        {
+            std::size_t const n = in.receive_up_to(batch_size, std::back_inserter(batch));
+            if (n == 0)
+            {
+                break;
+            }
+            stats.occupancy_sum.fetch_add(in.size(), std::memory_order_relaxed);
+            stats.occupancy_samples.fetch_add(1, std::memory_order_relaxed);
+            auto const begin = std::chrono::steady_clock::now();
+            for (T &item : batch)
+            {
+                if (!handle(std::move(item)))
+                {
+                    open = false;
+                    break;
+                }
+            }
+            auto const busy = std::chrono::steady_clock::now() - begin;
+            stats.busy_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(busy).count(),
+                                    std::memory_order_relaxed);
+            stats.items_in.fetch_add(n, std::memory_order_relaxed);
+            flush();
+            batch.clear();
+        }
+        if (!open)
+        {
+            in.close();
+        }
+    }
+
+    std::shared_ptr<pipeline_graph> graph;
+    std::shared_ptr<Channel<T>> output;
+};
+
+// 源头：gen(emit) 依次产生元素，emit 返回 false 时应该停止
+template <typename T, typename Gen>
+pipeline<T> make_pipeline(std::string name, Gen gen, std::size_t capacity = pipeline<T>::default_capacity)
+{
+    std::shared_ptr<pipeline_graph> graph = std::make_shared<pipeline_graph>();
+    pipeline_stage_stats *stats = graph->add_stage(std::move(name), 1, 0);
+    std::shared_ptr<Channel<T>> out = graph->template add_channel<T>(capacity);
+    graph->workers.push_back([gen, out, stats]() mutable
+                             {
+        pipeline_emitter<T> emit(*out);
+        auto const begin = std::chrono::steady_clock::now();
+        gen(emit);
+        auto const busy = std::chrono::steady_clock::now() - begin;
+        stats->busy_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(busy).count(),
+                                 std::memory_order_relaxed);
+        stats->items_out.fetch_add(emit.take_emitted(), std::memory_order_relaxed);
+        out->close(); });
+    return pipeline<T>(graph, out);
+}
+
+/* 构建好的流水线，start 启动所有工作者，wait 等待全部结束 */
+class pipeline_job
+{
+public:
+    explicit pipeline_job(std::shared_ptr<pipeline_graph> graph_) : graph(std::move(graph_)) {}
+
+    pipeline_job(pipeline_job &&) = default;
+    pipeline_job &operator=(pipeline_job &&) = default;
+
+    ~pipeline_job()
+    {
+        if (graph && graph->running)
+        {
+            cancel();
+            wait();
+        }
+    }
+
+    void start()
+    {
+        graph->started = std::chrono::steady_clock::now();
+        graph->running = true;
+        std::shared_ptr<ThreadPool> pool = ThreadPool::getInstance();
+        int idle = pool->idleThreadCount();
+        for (std::function<void()> &worker : graph->workers)
+        {
+            if (idle > 0)
+            {
+                std::future<void> fut = pool->commit(worker);
+                if (fut.valid())
+                {
+                    --idle;
+                    futures.push_back(std::move(fut));
+                    continue;
+                }
+            }
+            threads.emplace_back(worker);
+        }
+    }
+
+    void wait()
+    {
+        for (std::future<void> &fut : futures)
+        {
+            fut.get();
+        }
+        for (std::thread &th : threads)
+        {
+            th.join();
+        }
+        futures.clear();
+        threads.clear();
+        if (graph->running)
+        {
+            graph->finished = std::chrono::steady_clock::now();
+            graph->running = false;
+        }
+    }
+
+    void run()
+    {
+        start();
+        wait();
+    }
+
+    // 关闭所有通道，各阶段处理完手上的一批后退出
+    void cancel()
+    {
+        for (std::function<void()> &closer : graph->closers)
+        {
+            closer();
+        }
+    }
+
+    struct stage_report
+    {
+        std::string name;
+        unsigned parallelism;
+        std::uint64_t items_in;
+        std::uint64_t items_out;
+        double throughput;  // 每秒输出个数
+        double utilization; // 忙碌时间 / (运行时间 * 并行度)
+        double occupancy;   // 输入队列平均占用率，源头为 0
+    };
+
+    std::vector<stage_report> stats() const
+    {
+        auto const end = graph->running ? std::chrono::steady_clock::now() : graph->finished;
+        double const seconds = std::max(1e-9, std::chrono::duration<double>(end - graph->started).count());
+        std::vector<stage_report> reports;
+        for (auto const &stage : graph->stages)
+        {
+            stage_report r;
+            r.name = stage->name;
+            r.parallelism = stage->parallelism;
+            r.items_in = stage->items_in.load(std::memory_order_relaxed);
+            r.items_out = stage->items_out.load(std::memory_order_relaxed);
+            r.throughput = r.items_out / seconds;
+            r.utilization = stage->busy_ns.load(std::memory_order_relaxed) / 1e9 / (seconds * stage->parallelism);
+            std::uint64_t const samples = stage->occupancy_samples.load(std::memory_order_relaxed);
+            r.occupancy = samples == 0 || stage->capacity == 0
+                              ? 0.0
+                              : static_cast<double>(stage->occupancy_sum.load(std::memory_order_relaxed)) / samples / stage->capacity;
+            reports.push_back(r);
+        }
+        return reports;
+    }
+
+    void print_stats(std::ostream &os) const
+    {
+        os << std::left << std::setw(12) << "stage" << std::right << std::setw(6) << "par"
+           << std::setw(10) << "in" << std::setw(10) << "out" << std::setw(12) << "out/s"
+           << std::setw(8) << "busy" << std::setw(8) << "queue" << std::endl;
+        for (stage_report const &r : stats())
+        {
+            os << std::left << std::setw(12) << r.name << std::right << std::setw(6) << r.parallelism
+               << std::setw(10) << r.items_in << std::setw(10) << r.items_out
+               << std::setw(12) << static_cast<std::uint64_t>(r.throughput)
+               << std::setw(7) << static_cast<int>(r.utilization * 100) << "%"
+               << std::setw(7) << static_cast<int>(r.occupancy * 100) << "%" << std::endl;
+        }
+    }
+
+private:
+    std::shared_ptr<pipeline_graph> graph;
+    std::vector<std::future<void>> futures;
+    std::vector<std::thread> threads;
+};
+
+template <typename T>
+template <typename Fn>
+pipeline_job pipeline<T>::sink(std::string name, Fn fn, unsigned parallelism)
+{
+    parallelism = std::max(1u, parallelism);
+    pipeline_stage_stats *stats = graph->add_stage(std::move(name), parallelism, output->capacity());
+    std::shared_ptr<Channel<T>> in = output;
+    for (unsigned i = 0; i < parallelism; ++i)
+    {
+        graph->workers.push_back([in, stats, fn]() mutable
+                                 { drain(*in, *stats, [&](T &&item)
+                                         {
+                fn(std::move(item));
+                return true; }, []() {}); });
+    }
+    return pipeline_job(graph);
+}
+
+/* 测试：中间的 slow 阶段是瓶颈，它的利用率最高、输入队列接近满 */
+void TestPipeline()
+{
+    std::atomic<long> sum{0};
+    pipeline_job job = make_pipeline<int>("source", [](pipeline_emitter<int> &emit)
+                                          {
+                           for (int i = 1; i <= 20000; ++i)
+                           {
+                               if (!emit(i))
+                               {
+                                   break;
+                               }
+                           } })
+                           .map("square", [](int x)
+                                { return static_cast<long>(x) * x; })
+                           .filter("odd", [](long x)
+                                   { return x % 2 == 1; })
+                           .map("slow", [](long x)
+                                {
+                                    std::this_thread::sleep_for(std::chrono::microseconds(20));
+                                    return x; }, 2)
+                           .flat_map<long>("split", [](long x, pipeline_emitter<long> &emit)
+                                           {
+                                               emit(x / 2);
+                                               emit(x - x / 2); })
+                           .sink("sum", [&](long x)
+                                 { sum += x; });
+    job.run();
+    long expected = 0;
+    for (long i = 1; i <= 20000; i += 2)
+    {
+        expected += i * i;
+    }
+    std::cout << "sum is " << sum << ", expected " << expected << std::endl;
+    job.print_stats(std::cout);
+}
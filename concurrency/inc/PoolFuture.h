@@ -0,0 +1,659 @@
+#pragma once
+
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <optional>
+#include <exception>
+#include <type_traits>
+#include <utility>
+#include <chrono>
+#include "ThreadPool.h"
+
+/*
+ * 可以挂接后续操作的 future/promise
+ *   pool_future<std::string> f = pool_async([] { return 21; })
+ *                                    .then([](int x) { return x * 2; })
+ *                                    .then([](int x) { return std::to_string(x); });
+ *   pool_future<std::vector<int>> all = when_all(std::move(futures));
+ * ThreadPool::commit 返回的 std::future 只能 get，组合多个结果时总有线程阻塞在 get 上。
+ * 1. then(fn)：结果就绪后把 fn 投递到线程池执行，返回 fn 结果的 future，前面的异常直接传给后面，跳过 fn
+ * 2. when_all：全部就绪后得到所有结果（有异常时得到第一个异常）；when_any：第一个就绪的下标和结果
+ * 3. 后续操作本身就是下游的共享状态：then 只分配一个对象，里面同时放 fn 和结果；
+ *    when_all/when_any 为所有输入只分配一个对象，每个输入的挂接节点是它里面的数组元素
+ * 每个 future 只能挂接一个后续操作，then 之后原来的 future 失效；get 仍然可以阻塞等待
+ */
+template <typename T>
+class pool_future;
+template <typename T>
+class pool_promise;
+
+namespace pool_future_detail
+{
+    // void 的结果用一个空类型保存
+    struct unit
+    {
+    };
+
+    template <typename T>
+    using stored_t = typename std::conditional<std::is_void<T>::value, unit, T>::type;
+
+    // 结果就绪时由设置结果的线程调用，只做很少的工作，耗时的部分投递到线程池
+    class continuation
+    {
+    public:
+        virtual ~continuation() {}
+        virtual void invoke() = 0;
+    };
+
+    // 投递到线程池，线程池停止时在当前线程执行
+    inline void post(std::function<void()> task)
+    {
+        std::future<void> fut = ThreadPool::getInstance()->commit(task);
+        if (!fut.valid())
+        {
+            task();
+        }
+    }
+
+    template <typename T>
+    class state
+    {
+    public:
+        using value_type = stored_t<T>;
+
+        virtual ~state() {}
+
+        void set_value(value_type value)
+        {
+            finish([&]()
+                   { this->value.emplace(std::move(value)); });
+        }
+
+        void set_exception(std::exception_ptr e)
+        {
+            finish([&]()
+                   { error = e; });
+        }
+
+        // 已经就绪时由当前线程立即调用
+        void attach(std::shared_ptr<continuation> next)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!ready)
+                {
+                    cont = std::move(next);
+                    return;
+                }
+            }
+            next->invoke();
+        }
+
+        void wait()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this]()
+                      { return ready; });
+        }
+
+        bool is_ready()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return ready;
+        }
+
+        value_type get()
+        {
+            wait();
+            return take();
+        }
+
+        // 以下两个只能在就绪之后调用（wait 返回或者在后续操作中）
+        std::exception_ptr const &exception() const
+        {
+            return error;
+        }
+
+        value_type take()
+        {
+            if (error)
+            {
+                std::rethrow_exception(error);
+            }
+            return std::move(*value);
+        }
+
+    private:
+        template <typename Store>
+        void finish(Store store)
+        {
+            std::shared_ptr<continuation> next;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (ready)
+                {
+                    throw std::future_error(std::future_errc::promise_already_satisfied);
+                }
+                store();
+                ready = true;
+                next = std::move(cont);
+            }
+            cond.notify_all();
+            if (next)
+            {
+                next->invoke();
+            }
+        }
+
+        std::mutex mutex;
+        std::condition_variable cond;
+        bool ready = false;
+        std::optional<value_type> value;
+        std::exception_ptr error;
+        std::shared_ptr<continuation> cont;
+    };
+
+    // 用 value 调用 fn，void 的结果不传参数；fn 返回 void 时得到 unit
+    template <typename T, typename F>
+    auto call(F &fn, stored_t<T> &&value)
+    {
+        if constexpr (std::is_void<T>::value)
+        {
+            (void)value;
+            if constexpr (std::is_void<decltype(fn())>::value)
+            {
+                fn();
+                return unit{};
+            }
+            else
+            {
+                return fn();
+            }
+        }
+        else
+        {
+            if constexpr (std::is_void<decltype(fn(std::move(value)))>::value)
+            {
+                fn(std::move(value));
+                return unit{};
+            }
+            else
+            {
+                return fn(std::move(value));
+            }
+        }
+    }
+
+    template <typename T, typename F>
+    struct then_result
+    {
+        using type = decltype(std::declval<F &>()());
+    };
+
+    template <typename T, typename F>
+    struct then_result_nonvoid
+    {
+        using type = decltype(std::declval<F &>()(std::declval<T>()));
+    };
+
+    template <typename T, typename F>
+    using then_result_t = typename std::conditional<std::is_void<T>::value, then_result<T, F>, then_result_nonvoid<T, F>>::type::type;
+
+    // then 的后续操作：前一个结果就绪时把 fn 投递到线程池，自己就是 fn 结果的共享状态
+    template <typename T, typename U, typename F>
+    class then_state : public state<U>, public continuation, public std::enable_shared_from_this<then_state<T, U, F>>
+    {
+    public:
+        then_state(std::shared_ptr<state<T>> source_, F fn_) : source(std::move(source_)), fn(std::move(fn_)) {}
+
+        void invoke() override
+        {
+            std::shared_ptr<then_state> self = this->shared_from_this();
+            post([self]()
+                 { self->run(); });
+        }
+
+    private:
+        void run()
+        {
+            // 释放对前一个状态的引用，前一个状态也已经释放了对本对象的引用
+            std::shared_ptr<state<T>> src = std::move(source);
+            if (src->exception())
+            {
+                this->set_exception(src->exception());
+                return;
+            }
+            try
+            {
+                this->set_value(call<T>(fn, src->take()));
+            }
+            catch (...)
+            {
+                this->set_exception(std::current_exception());
+            }
+        }
+
+        std::shared_ptr<state<T>> source;
+        F fn;
+    };
+
+    // 多个输入的汇合：每个输入挂一个 node，所有 node 在同一个对象里
+    template <typename T, typename R>
+    class join_state : public state<R>
+    {
+    protected:
+        struct node : continuation
+        {
+            join_state *owner = nullptr;
+            std::size_t index = 0;
+            std::shared_ptr<state<T>> source;
+
+            void invoke() override
+            {
+                std::shared_ptr<state<T>> src = std::move(source);
+                owner->arrive(index, *src);
+            }
+        };
+
+        explicit join_state(std::size_t count) : nodes(count) {}
+
+        static pool_future<R> future_of(std::shared_ptr<state<R>> shared)
+        {
+            return pool_future<R>(std::move(shared));
+        }
+
+        // 由派生类在构造完成后调用，self 是指向本对象的 shared_ptr
+        void attach_all(std::shared_ptr<join_state> const &self, std::vector<pool_future<T>> &inputs)
+        {
+            for (std::size_t i = 0; i < inputs.size(); ++i)
+            {
+                nodes[i].owner = this;
+                nodes[i].index = i;
+                nodes[i].source = inputs[i].release();
+            }
+            // 先设置好所有节点再挂接，挂接时可能立即触发
+            for (std::size_t i = 0; i < nodes.size(); ++i)
+            {
+                std::shared_ptr<state<T>> src = nodes[i].source;
+                src->attach(std::shared_ptr<continuation>(self, &nodes[i]));
+            }
+        }
+
+        virtual void arrive(std::size_t index, state<T> &src) = 0;
+
+        std::vector<node> nodes;
+    };
+}
+
+// 第一个就绪的输入的下标和结果
+template <typename T>
+struct when_any_result
+{
+    std::size_t index;
+    T value;
+};
+
+template <>
+struct when_any_result<void>
+{
+    std::size_t index;
+};
+
+template <typename T>
+class pool_future
+{
+public:
+    pool_future() = default;
+    pool_future(pool_future &&) = default;
+    pool_future &operator=(pool_future &&) = default;
+    pool_future(pool_future const &) = delete;
+    pool_future &operator=(pool_future const &) = delete;
+
+    bool valid() const
+    {
+        return shared != nullptr;
+    }
+
+    bool is_ready() const
+    {
+        return shared->is_ready();
+    }
+
+    void wait() const
+    {
+        shared->wait();
+    }
+
+    // 阻塞等待结果，之后 future 失效
+    T get()
+    {
+        std::shared_ptr<pool_future_detail::state<T>> s = release();
+        if constexpr (std::is_void<T>::value)
+        {
+            s->get();
+        }
+        else
+        {
+            return s->get();
+        }
+    }
+
+    // 结果就绪后在线程池中执行 fn(value)，T 为 void 时执行 fn()；之后本 future 失效
+    template <typename F>
+    auto then(F fn) -> pool_future<pool_future_detail::then_result_t<T, F>>
+    {
+        using U = pool_future_detail::then_result_t<T, F>;
+        using node = pool_future_detail::then_state<T, U, F>;
+        std::shared_ptr<pool_future_detail::state<T>> source = release();
+        std::shared_ptr<node> next = std::make_shared<node>(source, std::move(fn));
+        source->attach(next);
+        return pool_future<U>(std::shared_ptr<pool_future_detail::state<U>>(next));
+    }
+
+private:
+    template <typename U>
+    friend class pool_future;
+    template <typename U>
+    friend class pool_promise;
+    template <typename U, typename R>
+    friend class pool_future_detail::join_state;
+
+    explicit pool_future(std::shared_ptr<pool_future_detail::state<T>> shared_) : shared(std::move(shared_)) {}
+
+    std::shared_ptr<pool_future_detail::state<T>> release()
+    {
+        if (!shared)
+        {
+            throw std::future_error(std::future_errc::no_state);
+        }
+        return std::move(shared);
+    }
+
+    std::shared_ptr<pool_future_detail::state<T>> shared;
+};
+
+template <typename T>
+class pool_promise
+{
+public:
+    pool_promise() : shared(std::make_shared<pool_future_detail::state<T>>()) {}
+    pool_promise(pool_promise &&) = default;
+    pool_promise &operator=(pool_promise &&) = default;
+    pool_promise(pool_promise const &) = delete;
+    pool_promise &operator=(pool_promise const &) = delete;
+
+    // 没有设置结果就析构时，future 得到 broken_promise，挂接的后续操作也会被释放
+    ~pool_promise()
+    {
+        if (shared && !shared->is_ready())
+        {
+            shared->set_exception(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+        }
+    }
+
+    pool_future<T> get_future()
+    {
+        if (retrieved)
+        {
+            throw std::future_error(std::future_errc::future_already_retrieved);
+        }
+        retrieved = true;
+        return pool_future<T>(shared);
+    }
+
+    template <typename V, typename U = T, typename = typename std::enable_if<!std::is_void<U>::value>::type>
+    void set_value(V &&value)
+    {
+        shared->set_value(std::forward<V>(value));
+    }
+
+    template <typename U = T, typename = typename std::enable_if<std::is_void<U>::value>::type>
+    void set_value()
+    {
+        shared->set_value(pool_future_detail::unit{});
+    }
+
+    void set_exception(std::exception_ptr e)
+    {
+        shared->set_exception(e);
+    }
+
+private:
+    std::shared_ptr<pool_future_detail::state<T>> shared;
+    bool retrieved = false;
+};
+
+// 在线程池中执行 f(args...)，返回可以挂接后续操作的 future
+template <typename F, typename... Args>
+auto pool_async(F &&f, Args &&...args) -> pool_future<decltype(f(args...))>
+{
+    using R = decltype(f(args...));
+    std::shared_ptr<pool_promise<R>> promise = std::make_shared<pool_promise<R>>();
+    pool_future<R> result = promise->get_future();
+    std::function<R()> task = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
+    pool_future_detail::post([promise, task]()
+                             {
+        try
+        {
+            if constexpr (std::is_void<R>::value)
+            {
+                task();
+                promise->set_value();
+            }
+            else
+            {
+                promise->set_value(task());
+            }
+        }
+        catch (...)
+        {
+            promise->set_exception(std::current_exception());
+        } });
+    return result;
+}
+
+template <typename T>
+pool_future<typename std::decay<T>::type> make_ready_future(T &&value)
+{
+    pool_promise<typename std::decay<T>::type> promise;
+    promise.set_value(std::forward<T>(value));
+    return promise.get_future();
+}
+
+namespace pool_future_detail
+{
+    template <typename T>
+    using all_result_t = typename std::conditional<std::is_void<T>::value, void, std::vector<T>>::type;
+
+    template <typename T>
+    class all_state : public join_state<T, all_result_t<T>>
+    {
+        using base = join_state<T, all_result_t<T>>;
+
+    public:
+        explicit all_state(std::size_t count) : base(count), values(count), remaining(count) {}
+
+        static pool_future<all_result_t<T>> start(std::vector<pool_future<T>> &inputs)
+        {
+            std::shared_ptr<all_state> self = std::make_shared<all_state>(inputs.size());
+            pool_future<all_result_t<T>> result = base::future_of(self);
+            if (inputs.empty())
+            {
+                self->complete();
+            }
+            else
+            {
+                self->attach_all(self, inputs);
+            }
+            return result;
+        }
+
+    private:
+        void arrive(std::size_t index, state<T> &src) override
+        {
+            if (src.exception())
+            {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!first_error)
+                {
+                    first_error = src.exception();
+                }
+            }
+            else
+            {
+                values[index].emplace(src.take());
+            }
+            if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                complete();
+            }
+        }
+
+        void complete()
+        {
+            if (first_error)
+            {
+                this->set_exception(first_error);
+                return;
+            }
+            if constexpr (std::is_void<T>::value)
+            {
+                this->set_value(unit{});
+            }
+            else
+            {
+                std::vector<T> result;
+                result.reserve(values.size());
+                for (std::optional<T> &v : values)
+                {
+                    result.push_back(std::move(*v));
+                }
+                this->set_value(std::move(result));
+            }
+        }
+
+        std::vector<std::optional<stored_t<T>>> values;
+        std::atomic<std::size_t> remaining;
+        std::mutex error_mutex;
+        std::exception_ptr first_error;
+    };
+
+    template <typename T>
+    class any_state : public join_state<T, when_any_result<T>>
+    {
+        using base = join_state<T, when_any_result<T>>;
+
+    public:
+        explicit any_state(std::size_t count) : base(count) {}
+
+        static pool_future<when_any_result<T>> start(std::vector<pool_future<T>> &inputs)
+        {
+            std::shared_ptr<any_state> self = std::make_shared<any_state>(inputs.size());
+            pool_future<when_any_result<T>> result = base::future_of(self);
+            self->attach_all(self, inputs);
+            return result;
+        }
+
+    private:
+        void arrive(std::size_t index, state<T> &src) override
+        {
+            if (done.exchange(true, std::memory_order_acq_rel))
+            {
+                return;
+            }
+            if (src.exception())
+            {
+                this->set_exception(src.exception());
+                return;
+            }
+            if constexpr (std::is_void<T>::value)
+            {
+                this->set_value(when_any_result<T>{index});
+            }
+            else
+            {
+                this->set_value(when_any_result<T>{index, src.take()});
+            }
+        }
+
+        std::atomic<bool> done{false};
+    };
+}
+
+// 所有输入都就绪后得到全部结果，按输入顺序排列；T 为 void 时结果也是 void
+template <typename T>
+pool_future<pool_future_detail::all_result_t<T>> when_all(std::vector<pool_future<T>> inputs)
+{
+    return pool_future_detail::all_state<T>::start(inputs);
+}
+
+// 第一个就绪的输入，它的异常也作为结果的异常；inputs 不能为空
+template <typename T>
+pool_future<when_any_result<T>> when_any(std::vector<pool_future<T>> inputs)
+{
+    if (inputs.empty())
+    {
+        throw std::future_error(std::future_errc::no_state);
+    }
+    return pool_future_detail::any_state<T>::start(inputs);
+}
+
+/* 测试：链式 then、when_all 汇总、when_any 取最快的、异常沿着 then 传递 */
+void TestPoolFuture()
+{
+    pool_future<std::string> chained = pool_async([]()
+                                                  { return 21; })
+                                           .then([](int x)
+                                                 { return x * 2; })
+                                           .then([](int x)
+                                                 { return "answer " + std::to_string(x); });
+    std::cout << chained.get() << std::endl;
+
+    std::vector<pool_future<long>> squares;
+    for (long i = 1; i <= 100; i++)
+    {
+        squares.push_back(pool_async([i]()
+                                     { return i * i; }));
+    }
+    pool_future<long> total = when_all(std::move(squares)).then([](std::vector<long> values)
+                                                                {
+        long sum = 0;
+        for (long v : values)
+        {
+            sum += v;
+        }
+        return sum; });
+    std::cout << "when_all sum is " << total.get() << ", expected " << 100L * 101 * 201 / 6 << std::endl;
+
+    std::vector<pool_future<int>> racers;
+    for (int i = 0; i < 3; i++)
+    {
+        racers.push_back(pool_async([i]()
+                                    {
+            std::this_thread::sleep_for(std::chrono::milliseconds(30 * (3 - i)));
+            return i; }));
+    }
+    when_any_result<int> winner = when_any(std::move(racers)).get();
+    std::cout << "when_any winner index " << winner.index << ", value " << winner.value << std::endl;
+
+    pool_future<void> failed = pool_async([]() -> int
+                                          { throw std::runtime_error("step failed"); })
+                                   .then([](int x)
+                                         { std::cout << "never runs " << x << std::endl; });
+    try
+    {
+        failed.get();
+    }
+    catch (std::exception const &e)
+    {
+        std::cout << "exception propagated: " << e.what() << std::endl;
+    }
+}
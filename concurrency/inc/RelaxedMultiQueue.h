@@ -0,0 +1,215 @@
+#pragma once
+
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <random>
+#include "threadsafe_queue.h"
+
+/*
+ * 松弛的分片多队列，用于不要求严格先进先出的工作队列
+ * threadsafe_queue 只有一把锁，所有生产者和消费者都在这把锁上串行。这里用 k * 线程数 个 threadsafe_queue 做分片：
+ * 1. push 随机挑两个分片，放进元素较少的那个
+ * 2. pop 随机挑两个分片，从元素较多的那个弹出，两个都为空时依次扫描所有分片
+ * 两选一（power-of-two-choices）让各分片长度的差距保持在很小的范围内，分片内部仍是先进先出，
+ * 所以一个元素最多被其他分片中排在它后面的少数元素插队，排名误差约为分片数乘以长度差，与总元素数无关。
+ * 只随机放一个分片的话，长度差会随元素数的平方根增长
+ * 接口与 threadsafe_queue 相同，可以直接替换，用顺序换取接近线性的扩展
+ */
+template <typename T>
+class relaxed_multi_queue
+{
+    struct alignas(64) shard_type
+    {
+        threadsafe_queue<T> queue;
+        // 元素个数的近似值，push 之后加一、pop 之后减一，只用来做两选一
+        std::atomic<long> size{0};
+    };
+
+public:
+    explicit relaxed_multi_queue(unsigned shards_per_thread = 4)
+    {
+        unsigned const threads = std::max(1u, std::thread::hardware_concurrency());
+        shard_count = std::max(2u, shards_per_thread * threads);
+        shards.reset(new shard_type[shard_count]);
+    }
+
+    relaxed_multi_queue(relaxed_multi_queue const &) = delete;
+    relaxed_multi_queue &operator=(relaxed_multi_queue const &) = delete;
+
+    void push(T value)
+    {
+        shard_type &shard = shards[pick(false)];
+        shard.queue.push(std::move(value));
+        shard.size.fetch_add(1, std::memory_order_relaxed);
+
+        // 与 wait_and_pop 中的 waiters 自增配对，保证等待者要么看到新元素，要么被唤醒
+        if (waiters.load(std::memory_order_seq_cst) != 0)
+        {
+            std::lock_guard<std::mutex> lk(wait_mutex);
+            wait_cv.notify_one();
+        }
+    }
+
+    void wait_and_pop(T &value)
+    {
+        if (try_pop(value))
+        {
+            return;
+        }
+        std::unique_lock<std::mutex> lk(wait_mutex);
+        waiters.fetch_add(1, std::memory_order_seq_cst);
+        while (!try_pop(value))
+        {
+            wait_cv.wait(lk);
+        }
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    std::shared_ptr<T> wait_and_pop()
+    {
+        T value;
+        wait_and_pop(value);
+        return std::make_shared<T>(std::move(value));
+    }
+
+    bool try_pop(T &value)
+    {
+        unsigned const index = pick(true);
+        if (pop_from(shards[index], value))
+        {
+            return true;
+        }
+        // 逐个分片加锁检查，保证只有在每个分片被检查时都为空才返回 false
+        for (unsigned i = 1; i <= shard_count; ++i)
+        {
+            if (pop_from(shards[(index + i) % shard_count], value))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // 队列为空时返回空指针
+    std::shared_ptr<T> try_pop()
+    {
+        T value;
+        if (!try_pop(value))
+        {
+            return std::shared_ptr<T>();
+        }
+        return std::make_shared<T>(std::move(value));
+    }
+
+    bool empty() const
+    {
+        for (unsigned i = 0; i < shard_count; ++i)
+        {
+            if (!shards[i].queue.empty())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    unsigned shards_size() const
+    {
+        return shard_count;
+    }
+
+private:
+    static unsigned random_below(unsigned bound)
+    {
+        thread_local std::minstd_rand engine(std::random_device{}());
+        return static_cast<unsigned>(engine() % bound);
+    }
+
+    // 随机挑两个分片，longer 为真时返回元素较多的一个，否则返回较少的一个
+    unsigned pick(bool longer) const
+    {
+        unsigned const first = random_below(shard_count);
+        unsigned const second = random_below(shard_count);
+        long const first_size = shards[first].size.load(std::memory_order_relaxed);
+        long const second_size = shards[second].size.load(std::memory_order_relaxed);
+        return (longer ? second_size > first_size : second_size < first_size) ? second : first;
+    }
+
+    static bool pop_from(shard_type &shard, T &value)
+    {
+        if (!shard.queue.try_pop(value))
+        {
+            return false;
+        }
+        shard.size.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    unsigned shard_count;
+    std::unique_ptr<shard_type[]> shards;
+
+    std::mutex wait_mutex;
+    std::condition_variable wait_cv;
+    std::atomic<unsigned> waiters{0};
+};
+
+/* 测试：单线程统计排名误差，多线程生产消费检查元素不丢不重 */
+void TestRelaxedMultiQueue()
+{
+    relaxed_multi_queue<long> queue;
+    for (long i = 0; i < 100000; i++)
+    {
+        queue.push(i);
+    }
+    // 第 n 次弹出的元素理想情况下是 n，两者之差就是排名误差
+    long max_error = 0;
+    long total_error = 0;
+    long value = 0;
+    for (long n = 0; queue.try_pop(value); n++)
+    {
+        long const error = value > n ? value - n : n - value;
+        max_error = std::max(max_error, error);
+        total_error += error;
+    }
+    std::cout << "shards " << queue.shards_size() << ", max rank error " << max_error
+              << ", average rank error " << total_error / 100000 << std::endl;
+
+    std::atomic<long> sum{0};
+    std::vector<std::thread> consumers;
+    for (int t = 0; t < 4; t++)
+    {
+        consumers.emplace_back([&]()
+                               {
+            for (int i = 0; i < 20000; i++)
+            {
+                long v = 0;
+                queue.wait_and_pop(v);
+                sum += v;
+            } });
+    }
+    std::vector<std::thread> producers;
+    for (int t = 0; t < 4; t++)
+    {
+        producers.emplace_back([&, t]()
+                               {
+            for (long i = 1; i <= 20000; i++)
+            {
+                queue.push(t * 20000 + i);
+            } });
+    }
+    for (auto &th : producers)
+    {
+        th.join();
+    }
+    for (auto &th : consumers)
+    {
+        th.join();
+    }
+    std::cout << "pop sum is " << sum << ", expected " << 80000L * 80001 / 2 << std::endl;
+}
@@ -2,6 +2,8 @@
 // Created by mater on 2024/5/17.
 //
 
+#pragma once
+
 #include <memory>
 #include <mutex>
 #include <iostream>
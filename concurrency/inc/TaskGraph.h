@@ -0,0 +1,376 @@
+#pragma once
+
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <queue>
+#include <random>
+#include <chrono>
+#include <stdexcept>
+#include <exception>
+#include <algorithm>
+#include "ThreadPool.h"
+
+/*
+ * 任务图（DAG）执行器
+ *   task_graph g;
+ *   auto load = g.emplace("load", [] { ... });
+ *   auto parse = g.emplace("parse", [] { ... }, 3); // 第三个参数是估计的耗时，用于计算关键路径
+ *   g.precede(load, parse);                         // load 完成之后才能执行 parse
+ *   g.run();                                        // 阻塞到所有任务完成，可以反复执行
+ * 1. 每次 run 把每个任务的剩余前驱数重置为入度，一个任务完成后把后继的计数减一，减到 0 的立即就绪，
+ *    不需要任何线程阻塞在 future.get() 上等前驱
+ * 2. 就绪的任务放在按优先级排序的就绪堆中，优先级是从该任务到出口的最长路径耗时（bottom level），
+ *    关键路径上的任务先执行，整张图的完成时间更短
+ * 3. 每就绪一个任务向线程池投递一个"取一个就绪任务来执行"的令牌；执行完的工作者如果让后继就绪，
+ *    自己接着执行其中优先级最高的，少投递一次
+ * 4. 调用 run 的线程也从就绪堆中取任务执行，线程池停止或所有线程都在忙时图也能执行完，
+ *    在线程池的任务中调用 run 也不会因为占着线程等待而死锁
+ * 任务抛出的第一个异常由 run 重新抛出，之后的任务不再执行；图的结构在 run 期间不能修改，也不能同时 run 两次
+ */
+class task_graph
+{
+public:
+    using task_id = std::size_t;
+
+    task_graph() = default;
+    task_graph(task_graph const &) = delete;
+    task_graph &operator=(task_graph const &) = delete;
+
+    task_id emplace(std::string name, std::function<void()> fn, double cost = 1.0)
+    {
+        nodes.push_back(node{std::move(name), std::move(fn), cost, {}, 0, 0.0});
+        ranked = false;
+        return nodes.size() - 1;
+    }
+
+    // before 完成之后才能执行 after
+    void precede(task_id before, task_id after)
+    {
+        if (before >= nodes.size() || after >= nodes.size() || before == after)
+        {
+            throw std::invalid_argument("task_graph: invalid edge");
+        }
+        nodes[before].successors.push_back(after);
+        ++nodes[after].in_degree;
+        ranked = false;
+    }
+
+    std::size_t size() const
+    {
+        return nodes.size();
+    }
+
+    std::string const &name(task_id id) const
+    {
+        return nodes[id].name;
+    }
+
+    // 关键路径的总耗时，图中有环时抛出 std::logic_error
+    double critical_path()
+    {
+        rank();
+        double longest = 0.0;
+        for (node const &n : nodes)
+        {
+            longest = std::max(longest, n.rank);
+        }
+        return longest;
+    }
+
+    void run()
+    {
+        rank();
+        if (nodes.empty())
+        {
+            return;
+        }
+        std::shared_ptr<run_state> state = std::make_shared<run_state>(*this);
+        std::vector<task_id> sources;
+        for (task_id id = 0; id < nodes.size(); ++id)
+        {
+            if (nodes[id].in_degree == 0)
+            {
+                sources.push_back(id);
+            }
+        }
+        state->make_ready(sources);
+
+        // 调用线程一边等一边帮忙执行
+        std::unique_lock<std::mutex> lock(state->mutex);
+        while (state->remaining != 0)
+        {
+            if (!state->ready.empty())
+            {
+                lock.unlock();
+                run_state::work(state);
+                lock.lock();
+                continue;
+            }
+            state->cond.wait(lock);
+        }
+        if (state->error)
+        {
+            std::rethrow_exception(state->error);
+        }
+    }
+
+private:
+    struct node
+    {
+        std::string name;
+        std::function<void()> fn;
+        double cost;
+        std::vector<task_id> successors;
+        std::size_t in_degree;
+        double rank; // 从该任务开始到出口的最长路径耗时
+    };
+
+    // 一次执行的状态，线程池中晚到的令牌可能在 run 返回之后才执行，用 shared_ptr 保持存活
+    struct run_state : std::enable_shared_from_this<run_state>
+    {
+        explicit run_state(task_graph &graph_)
+            : graph(graph_), pending(new std::atomic<std::size_t>[graph_.nodes.size()]), remaining(graph_.nodes.size())
+        {
+            for (task_id id = 0; id < graph.nodes.size(); ++id)
+            {
+                pending[id].store(graph.nodes[id].in_degree, std::memory_order_relaxed);
+            }
+        }
+
+        struct by_rank
+        {
+            task_graph const *graph;
+            bool operator()(task_id lhs, task_id rhs) const
+            {
+                return graph->nodes[lhs].rank < graph->nodes[rhs].rank;
+            }
+        };
+
+        // 放入就绪堆并投递令牌，keep_one 表示当前工作者自己接着执行一个，少投递一个令牌
+        void make_ready(std::vector<task_id> const &ids, bool keep_one = false)
+        {
+            if (ids.empty())
+            {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (task_id id : ids)
+                {
+                    ready.push(id);
+                }
+            }
+            cond.notify_one();
+            std::shared_ptr<ThreadPool> pool = ThreadPool::getInstance();
+            std::size_t const tokens = keep_one ? ids.size() - 1 : ids.size();
+            std::shared_ptr<run_state> self = this->shared_from_this();
+            for (std::size_t i = 0; i < tokens; ++i)
+            {
+                // 线程池停止时投递失败，就绪任务留给调用 run 的线程
+                pool->commit([self]()
+                             { work(self); });
+            }
+        }
+
+        // 取优先级最高的就绪任务执行，执行完如果让后继就绪就接着执行；没有就绪任务时直接返回
+        static void work(std::shared_ptr<run_state> const &state)
+        {
+            for (;;)
+            {
+                task_id id;
+                {
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    if (state->ready.empty())
+                    {
+                        return;
+                    }
+                    id = state->ready.top();
+                    state->ready.pop();
+                }
+                node const &n = state->graph.nodes[id];
+                if (!state->failed.load(std::memory_order_relaxed))
+                {
+                    try
+                    {
+                        n.fn();
+                    }
+                    catch (...)
+                    {
+                        std::lock_guard<std::mutex> lock(state->mutex);
+                        if (!state->error)
+                        {
+                            state->error = std::current_exception();
+                        }
+                        state->failed.store(true, std::memory_order_relaxed);
+                    }
+                }
+                std::vector<task_id> next;
+                for (task_id succ : n.successors)
+                {
+                    if (state->pending[succ].fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    {
+                        next.push_back(succ);
+                    }
+                }
+                state->make_ready(next, true);
+                bool done = false;
+                {
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    done = --state->remaining == 0;
+                }
+                if (done)
+                {
+                    state->cond.notify_all();
+                }
+                if (next.empty())
+                {
+                    return;
+                }
+            }
+        }
+
+        task_graph &graph;
+        std::unique_ptr<std::atomic<std::size_t>[]> pending;
+
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::priority_queue<task_id, std::vector<task_id>, by_rank> ready{by_rank{&graph}};
+        std::size_t remaining;
+        std::atomic<bool> failed{false};
+        std::exception_ptr error;
+    };
+
+    // 按拓扑逆序计算 bottom level，顺便检查有没有环；图没有变化时不重新计算
+    void rank()
+    {
+        if (ranked)
+        {
+            return;
+        }
+        std::vector<std::size_t> degree(nodes.size());
+        std::vector<task_id> order;
+        order.reserve(nodes.size());
+        for (task_id id = 0; id < nodes.size(); ++id)
+        {
+            degree[id] = nodes[id].in_degree;
+            if (degree[id] == 0)
+            {
+                order.push_back(id);
+            }
+        }
+        for (std::size_t i = 0; i < order.size(); ++i)
+        {
+            for (task_id succ : nodes[order[i]].successors)
+            {
+                if (--degree[succ] == 0)
+                {
+                    order.push_back(succ);
+                }
+            }
+        }
+        if (order.size() != nodes.size())
+        {
+            throw std::logic_error("task_graph: graph has a cycle");
+        }
+        for (auto it = order.rbegin(); it != order.rend(); ++it)
+        {
+            node &n = nodes[*it];
+            double longest = 0.0;
+            for (task_id succ : n.successors)
+            {
+                longest = std::max(longest, nodes[succ].rank);
+            }
+            n.rank = n.cost + longest;
+        }
+        ranked = true;
+    }
+
+    std::vector<node> nodes;
+    bool ranked = false;
+};
+
+/* 测试：随机分层 DAG 反复执行，检查每条边的先后顺序；再比较一条长链加一堆短任务时关键路径优先的效果 */
+void TestTaskGraph()
+{
+    task_graph graph;
+    int const layers = 6;
+    int const width = 20;
+    std::vector<std::atomic<long>> finished(layers * width);
+    std::atomic<long> clock{0};
+    for (int i = 0; i < layers * width; i++)
+    {
+        graph.emplace("t" + std::to_string(i), [&finished, &clock, i]()
+                      { finished[i] = ++clock; });
+    }
+    std::vector<std::pair<int, int>> edges;
+    std::minstd_rand engine(7);
+    for (int layer = 1; layer < layers; layer++)
+    {
+        for (int i = 0; i < width; i++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                int const from = (layer - 1) * width + static_cast<int>(engine() % width);
+                int const to = layer * width + i;
+                graph.precede(from, to);
+                edges.emplace_back(from, to);
+            }
+        }
+    }
+    int violations = 0;
+    for (int round = 0; round < 3; round++)
+    {
+        graph.run();
+        for (auto const &e : edges)
+        {
+            if (finished[e.first] >= finished[e.second])
+            {
+                violations++;
+            }
+        }
+    }
+    std::cout << "dag tasks " << graph.size() << ", edges " << edges.size()
+              << ", 3 runs, order violations " << violations << std::endl;
+
+    // 一条 8 个任务的长链和 40 个独立的短任务，链头如果排在短任务后面整张图会晚结束
+    task_graph mixed;
+    auto busy = []()
+    { std::this_thread::sleep_for(std::chrono::milliseconds(5)); };
+    for (int i = 0; i < 40; i++)
+    {
+        mixed.emplace("short" + std::to_string(i), busy);
+    }
+    task_graph::task_id prev = mixed.emplace("chain0", busy);
+    for (int i = 1; i < 8; i++)
+    {
+        task_graph::task_id const next = mixed.emplace("chain" + std::to_string(i), busy);
+        mixed.precede(prev, next);
+        prev = next;
+    }
+    auto const begin = std::chrono::steady_clock::now();
+    mixed.run();
+    auto const elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin);
+    std::cout << "critical path " << mixed.critical_path() << " tasks, run took " << elapsed.count() << "ms" << std::endl;
+
+    task_graph cyclic;
+    task_graph::task_id a = cyclic.emplace("a", []() {});
+    task_graph::task_id b = cyclic.emplace("b", []() {});
+    cyclic.precede(a, b);
+    cyclic.precede(b, a);
+    try
+    {
+        cyclic.run();
+    }
+    catch (std::logic_error const &e)
+    {
+        std::cout << "cycle detected: " << e.what() << std::endl;
+    }
+}
@@ -1,3 +1,5 @@
+#pragma once
+
 #include "Singleton.h"
 #include <future>
 #include <vector>
@@ -112,7 +114,7 @@ private:
     std::mutex mutex_;
     std::condition_variable cond_;
     std::atomic_int thread_num_;
-    std::atomic_bool stop_;
+    std::atomic_bool stop_{false};
     std::queue<Task> tasks_;
     std::vector<std::thread> pool_;
 };
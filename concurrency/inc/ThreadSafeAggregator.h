@@ -0,0 +1,364 @@
+#pragma once
+
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <array>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <limits>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <algorithm>
+
+/*
+ * 分片聚合表，用于指标统计这类"写多读少"的场景
+ * threadsafe_lookup_table 每次累加都要对同一个桶加独占锁，热点 key 会让所有线程串行。
+ * 这里每个线程第一次写入时分配一个自己的分片，之后只写自己的分片，分片的锁只会在读取合并时被争用；
+ * 读取时遍历所有分片，按 Merge 策略把同一个 key 的值合并起来。
+ *
+ * Merge 策略需要提供：
+ *   value_type                          聚合值类型
+ *   static value_type init()            单位元，合并的起点
+ *   static void accumulate(value_type &, Input const &)   把一次写入累加进来
+ *   static void merge(value_type &, value_type const &)   合并两个分片的值
+ */
+
+// 求和
+template <typename T>
+struct sum_merge
+{
+    typedef T value_type;
+    static T init() { return T(); }
+    static void accumulate(T &into, T const &in) { into += in; }
+    static void merge(T &into, T const &from) { into += from; }
+};
+
+// 最小值
+template <typename T>
+struct min_merge
+{
+    typedef T value_type;
+    static T init() { return std::numeric_limits<T>::max(); }
+    static void accumulate(T &into, T const &in)
+    {
+        if (in < into)
+            into = in;
+    }
+    static void merge(T &into, T const &from) { accumulate(into, from); }
+};
+
+// 最大值
+template <typename T>
+struct max_merge
+{
+    typedef T value_type;
+    static T init() { return std::numeric_limits<T>::lowest(); }
+    static void accumulate(T &into, T const &in)
+    {
+        if (into < in)
+            into = in;
+    }
+    static void merge(T &into, T const &from) { accumulate(into, from); }
+};
+
+/* HyperLogLog 基数估计，2^Precision 个寄存器，标准误差约为 1.04 / sqrt(2^Precision) */
+template <unsigned Precision = 12>
+class hyperloglog
+{
+    static_assert(Precision >= 4 && Precision <= 16, "Precision must be in [4, 16]");
+
+public:
+    static constexpr std::size_t register_count = std::size_t(1) << Precision;
+
+    hyperloglog() : registers() {}
+
+    // 传入元素的哈希值，内部会再打散一次，所以 std::hash<int> 这种恒等哈希也可以直接用
+    void add(std::uint64_t hash)
+    {
+        hash = mix(hash);
+        std::size_t const index = hash >> (64 - Precision);
+        std::uint64_t const rest = hash << Precision;
+        // rest 中第一个 1 的位置，全 0 时取最大值
+        std::uint8_t rank = 1;
+        while (rank <= 64 - Precision && (rest & (std::uint64_t(1) << (64 - rank))) == 0)
+        {
+            ++rank;
+        }
+        if (rank > registers[index])
+        {
+            registers[index] = rank;
+        }
+    }
+
+    // 合并就是逐个寄存器取最大值
+    void merge(hyperloglog const &other)
+    {
+        for (std::size_t i = 0; i < register_count; ++i)
+        {
+            if (other.registers[i] > registers[i])
+            {
+                registers[i] = other.registers[i];
+            }
+        }
+    }
+
+    double estimate() const
+    {
+        double const m = static_cast<double>(register_count);
+        double sum = 0;
+        std::size_t zeros = 0;
+        for (std::size_t i = 0; i < register_count; ++i)
+        {
+            sum += std::ldexp(1.0, -registers[i]);
+            if (registers[i] == 0)
+            {
+                ++zeros;
+            }
+        }
+        double const alpha = 0.7213 / (1.0 + 1.079 / m);
+        double const raw = alpha * m * m / sum;
+        // 小基数时用线性计数修正
+        if (raw <= 2.5 * m && zeros != 0)
+        {
+            return m * std::log(m / static_cast<double>(zeros));
+        }
+        return raw;
+    }
+
+private:
+    // splitmix64 的终结函数
+    static std::uint64_t mix(std::uint64_t x)
+    {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+    }
+
+    std::array<std::uint8_t, register_count> registers;
+};
+
+// HyperLogLog 合并策略，写入的是元素的哈希值
+template <unsigned Precision = 12>
+struct hll_merge
+{
+    typedef hyperloglog<Precision> value_type;
+    static value_type init() { return value_type(); }
+    static void accumulate(value_type &into, std::uint64_t hash) { into.add(hash); }
+    static void merge(value_type &into, value_type const &from) { into.merge(from); }
+};
+
+template <typename Key, typename Merge, typename Hash = std::hash<Key>>
+class sharded_aggregation_map
+{
+public:
+    typedef typename Merge::value_type Value;
+
+private:
+    // 分片类型，每个线程独占一个，对齐到缓存行避免伪共享
+    struct alignas(64) shard_type
+    {
+        // 平时只有所属线程加锁，不会有竞争；读取合并时才会与读者竞争
+        std::mutex mutex;
+        std::unordered_map<Key, Value, Hash> data;
+
+        explicit shard_type(Hash const &hasher) : data(16, hasher) {}
+    };
+
+    // 用全局递增的编号区分实例，避免对象析构后地址被复用导致线程拿到失效的分片
+    static std::uint64_t next_id()
+    {
+        static std::atomic<std::uint64_t> id{0};
+        return ++id;
+    }
+
+    // 每个线程一张表，记录该线程在各个实例中的分片；表登记在全局的 registry 中，
+    // 实例析构时从所有线程的表中删掉自己，不会随着实例的创建销毁无限增长
+    struct thread_slots;
+
+    struct slot_registry
+    {
+        std::mutex mutex;
+        std::vector<thread_slots *> tables;
+    };
+
+    // 故意不析构，线程的 thread_local 表在进程退出时析构，仍然要用到 registry
+    static slot_registry &registry()
+    {
+        static slot_registry *r = new slot_registry;
+        return *r;
+    }
+
+    struct thread_slots
+    {
+        // 平时只有所属线程加锁，只在实例析构时与析构线程竞争
+        std::mutex mutex;
+        std::unordered_map<std::uint64_t, shard_type *> shards;
+
+        thread_slots()
+        {
+            slot_registry &r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            r.tables.push_back(this);
+        }
+
+        ~thread_slots()
+        {
+            slot_registry &r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            r.tables.erase(std::find(r.tables.begin(), r.tables.end(), this));
+        }
+    };
+
+    // 找到当前线程在本实例中的分片，第一次访问时创建
+    shard_type &local_shard()
+    {
+        thread_local thread_slots local;
+        std::lock_guard<std::mutex> local_lock(local.mutex);
+        auto found = local.shards.find(id);
+        if (found != local.shards.end())
+        {
+            return *found->second;
+        }
+        std::lock_guard<std::mutex> lock(shards_mutex);
+        shards.emplace_back(new shard_type(hasher));
+        shard_type *shard = shards.back().get();
+        local.shards.emplace(id, shard);
+        return *shard;
+    }
+
+    std::uint64_t const id;
+    Hash hasher;
+    // 所有线程的分片，线程退出后分片仍然保留，数据不会丢失
+    mutable std::mutex shards_mutex;
+    std::vector<std::unique_ptr<shard_type>> shards;
+
+public:
+    explicit sharded_aggregation_map(Hash const &hasher_ = Hash()) : id(next_id()), hasher(hasher_) {}
+
+    // 析构时不应该再有其他线程写入
+    ~sharded_aggregation_map()
+    {
+        slot_registry &r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        for (thread_slots *table : r.tables)
+        {
+            std::lock_guard<std::mutex> table_lock(table->mutex);
+            table->shards.erase(id);
+        }
+    }
+
+    sharded_aggregation_map(sharded_aggregation_map const &other) = delete;
+    sharded_aggregation_map &operator=(sharded_aggregation_map const &other) = delete;
+
+    // 把 input 累加到当前线程分片中 key 对应的值上，例如 sum_merge 下就是加上 input
+    template <typename Input>
+    void update(Key const &key, Input const &input)
+    {
+        shard_type &shard = local_shard();
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto found = shard.data.find(key);
+        if (found == shard.data.end())
+        {
+            found = shard.data.emplace(key, Merge::init()).first;
+        }
+        Merge::accumulate(found->second, input);
+    }
+
+    // 合并所有分片中 key 对应的值，任一分片存在该 key 则返回 true
+    bool get(Key const &key, Value &value) const
+    {
+        Value res = Merge::init();
+        bool found_any = false;
+        std::lock_guard<std::mutex> lock(shards_mutex);
+        for (auto const &shard : shards)
+        {
+            std::lock_guard<std::mutex> shard_lock(shard->mutex);
+            auto found = shard->data.find(key);
+            if (found != shard->data.end())
+            {
+                Merge::merge(res, found->second);
+                found_any = true;
+            }
+        }
+        if (found_any)
+        {
+            value = res;
+        }
+        return found_any;
+    }
+
+    Value value_for(Key const &key, Value const &default_value = Merge::init()) const
+    {
+        Value value;
+        return get(key, value) ? value : default_value;
+    }
+
+    // 合并所有分片得到完整的快照，每次只锁一个分片，不会阻塞其他线程的写入太久
+    std::map<Key, Value> get_map() const
+    {
+        std::map<Key, Value> res;
+        std::lock_guard<std::mutex> lock(shards_mutex);
+        for (auto const &shard : shards)
+        {
+            std::lock_guard<std::mutex> shard_lock(shard->mutex);
+            for (auto const &item : shard->data)
+            {
+                auto inserted = res.emplace(item.first, Merge::init());
+                Merge::merge(inserted.first->second, item.second);
+            }
+        }
+        return res;
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(shards_mutex);
+        for (auto const &shard : shards)
+        {
+            std::lock_guard<std::mutex> shard_lock(shard->mutex);
+            shard->data.clear();
+        }
+    }
+};
+
+/* 测试 */
+void TestShardedAggregationMap()
+{
+    sharded_aggregation_map<std::string, sum_merge<long>> counters;
+    sharded_aggregation_map<std::string, min_merge<int>> min_latency;
+    sharded_aggregation_map<std::string, max_merge<int>> max_latency;
+    sharded_aggregation_map<std::string, hll_merge<>> unique_users;
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; t++)
+    {
+        threads.emplace_back([&, t]()
+                             {
+            for (int i = 0; i < 10000; i++)
+            {
+                // 所有线程都写同一个热点 key，但各写各的分片
+                counters.update("requests", 1L);
+                min_latency.update("latency", t * 10000 + i);
+                max_latency.update("latency", t * 10000 + i);
+                // 每个线程有一半用户与其他线程重复，总共 45000 个不同用户
+                unique_users.update("users", static_cast<std::uint64_t>(t * 5000 + i));
+            } });
+    }
+    for (auto &th : threads)
+    {
+        th.join();
+    }
+
+    std::cout << "requests is " << counters.value_for("requests") << std::endl;
+    std::cout << "min latency is " << min_latency.value_for("latency")
+              << ", max latency is " << max_latency.value_for("latency") << std::endl;
+    std::cout << "unique users is about " << unique_users.value_for("users").estimate() << std::endl;
+}
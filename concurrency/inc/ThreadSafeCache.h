@@ -0,0 +1,400 @@
+#pragma once
+
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+#include <cassert>
+
+/*
+ * 有容量上限的并发缓存，结构沿用 threadsafe_lookup_table：按 key 的哈希值分片，每个分片一把共享锁。
+ * 1. 容量按 charge 计算，默认每个元素 charge 为 1 即按条目数限制，也可以传入字节数按内存限制
+ * 2. 每个分片内部用 CLOCK 算法近似 LRU：读操作只在共享锁下把元素的 referenced 标记置位，
+ *    不移动链表节点，所以读者之间不会互相阻塞；淘汰时由写者在独占锁下转动时钟指针
+ * 3. 每个元素可以设置过期时间 ttl，过期的元素读取时视为未命中，淘汰时优先被回收
+ */
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class threadsafe_lru_cache
+{
+public:
+    typedef std::chrono::steady_clock clock_type;
+
+    // 命中、未命中、淘汰、过期的统计
+    struct cache_stats
+    {
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t evictions = 0;
+        std::uint64_t expirations = 0;
+    };
+
+private:
+    // 分片类型，对齐到缓存行，避免相邻分片的锁和计数器伪共享
+    class alignas(64) shard_type
+    {
+        friend class threadsafe_lru_cache;
+
+    private:
+        struct entry
+        {
+            Key key;
+            Value value;
+            std::size_t charge;
+            // time_point::max() 表示永不过期
+            clock_type::time_point expire;
+            // CLOCK 算法的访问标记，读者在共享锁下修改，所以必须是原子的
+            std::atomic<bool> referenced;
+
+            entry(Key const &key_, Value const &value_, std::size_t charge_, clock_type::time_point expire_)
+                : key(key_), value(value_), charge(charge_), expire(expire_), referenced(false)
+            {
+            }
+        };
+        // 用链表做时钟环，节点地址稳定，迭代器在插入删除其他节点时不会失效
+        typedef std::list<entry> entry_list;
+        typedef typename entry_list::iterator entry_iterator;
+
+        entry_list entries;
+        std::unordered_map<Key, entry_iterator, Hash> index;
+        // 时钟指针
+        entry_iterator hand;
+        std::size_t usage = 0;
+        std::size_t capacity = 0;
+        mutable std::shared_mutex mutex;
+
+        std::atomic<std::uint64_t> hits{0};
+        std::atomic<std::uint64_t> misses{0};
+        std::atomic<std::uint64_t> evictions{0};
+        std::atomic<std::uint64_t> expirations{0};
+
+        static bool expired(entry const &e, clock_type::time_point now)
+        {
+            return e.expire <= now;
+        }
+
+        // 调用方需持有独占锁
+        void erase_entry(entry_iterator it)
+        {
+            if (hand == it)
+            {
+                ++hand;
+            }
+            usage -= it->charge;
+            index.erase(it->key);
+            entries.erase(it);
+        }
+
+        // 转动时钟指针淘汰一个元素，调用方需持有独占锁且链表中除 keep 外还有元素
+        // 过期元素或者 referenced 为 false 的元素会被淘汰，否则清除标记给它第二次机会
+        // keep 是正在写入的元素，跳过它，否则 put 返回 true 时元素可能已经被淘汰
+        void evict_one(clock_type::time_point now, entry_iterator keep)
+        {
+            for (;;)
+            {
+                if (hand == entries.end())
+                {
+                    hand = entries.begin();
+                }
+                entry_iterator current = hand;
+                if (current == keep)
+                {
+                    ++hand;
+                    continue;
+                }
+                if (expired(*current, now))
+                {
+                    erase_entry(current);
+                    expirations.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                if (current->referenced.load(std::memory_order_relaxed))
+                {
+                    current->referenced.store(false, std::memory_order_relaxed);
+                    ++hand;
+                    continue;
+                }
+                erase_entry(current);
+                evictions.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+
+    public:
+        shard_type() : hand(entries.end())
+        {
+        }
+
+        bool get(Key const &key, Value &value)
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            auto found = index.find(key);
+            if (found == index.end())
+            {
+                misses.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            entry &e = *found->second;
+            if (expired(e, clock_type::now()))
+            {
+                // 共享锁下不能删除，留给写者或者 purge_expired 回收
+                misses.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            // 已经置位就不再写，减少缓存行的写竞争
+            if (!e.referenced.load(std::memory_order_relaxed))
+            {
+                e.referenced.store(true, std::memory_order_relaxed);
+            }
+            value = e.value;
+            hits.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        bool put(Key const &key, Value const &value, std::size_t charge, clock_type::time_point expire)
+        {
+            // 单个元素超过分片容量，放不进来
+            if (charge > capacity)
+            {
+                return false;
+            }
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            entry_iterator it;
+            auto found = index.find(key);
+            if (found != index.end())
+            {
+                it = found->second;
+                entry &e = *it;
+                usage = usage - e.charge + charge;
+                e.value = value;
+                e.charge = charge;
+                e.expire = expire;
+                e.referenced.store(true, std::memory_order_relaxed);
+            }
+            else
+            {
+                // 新元素插在时钟指针前面，相当于放在环的"最新"位置
+                it = entries.emplace(hand, key, value, charge, expire);
+                index.emplace(key, it);
+                usage += charge;
+            }
+            // charge 不超过容量，超出时环上一定还有别的元素可以淘汰
+            clock_type::time_point const now = clock_type::now();
+            while (usage > capacity)
+            {
+                evict_one(now, it);
+            }
+            return true;
+        }
+
+        bool remove(Key const &key)
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            auto found = index.find(key);
+            if (found == index.end())
+            {
+                return false;
+            }
+            erase_entry(found->second);
+            return true;
+        }
+
+        std::size_t purge_expired(clock_type::time_point now)
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            std::size_t count = 0;
+            for (entry_iterator it = entries.begin(); it != entries.end();)
+            {
+                entry_iterator current = it++;
+                if (expired(*current, now))
+                {
+                    erase_entry(current);
+                    ++count;
+                }
+            }
+            expirations.fetch_add(count, std::memory_order_relaxed);
+            return count;
+        }
+    };
+
+    std::vector<std::unique_ptr<shard_type>> shards;
+    Hash hasher;
+
+    shard_type &get_shard(Key const &key) const
+    {
+        std::size_t const shard_index = hasher(key) % shards.size();
+        return *shards[shard_index];
+    }
+
+public:
+    // capacity 为总容量，平均分给每个分片
+    explicit threadsafe_lru_cache(std::size_t capacity, unsigned num_shards = 19, Hash const &hasher_ = Hash())
+        : shards(num_shards == 0 ? 1 : num_shards), hasher(hasher_)
+    {
+        std::size_t per_shard = capacity / shards.size();
+        if (per_shard == 0)
+        {
+            per_shard = 1;
+        }
+        for (unsigned i = 0; i < shards.size(); ++i)
+        {
+            shards[i].reset(new shard_type);
+            shards[i]->capacity = per_shard;
+        }
+    }
+
+    threadsafe_lru_cache(threadsafe_lru_cache const &other) = delete;
+    threadsafe_lru_cache &operator=(threadsafe_lru_cache const &other) = delete;
+
+    // 命中返回 true 并把值拷贝到 value 中
+    bool get(Key const &key, Value &value)
+    {
+        return get_shard(key).get(key, value);
+    }
+
+    // 与 threadsafe_lookup_table 相同的接口，未命中返回默认值
+    Value value_for(Key const &key, Value const &default_value = Value())
+    {
+        Value value;
+        return get(key, value) ? value : default_value;
+    }
+
+    // 插入或更新，charge 为占用的容量，ttl 为 0 表示不过期
+    // 元素 charge 超过单个分片容量时插入失败返回 false
+    bool put(Key const &key, Value const &value, std::size_t charge = 1,
+             std::chrono::milliseconds ttl = std::chrono::milliseconds(0))
+    {
+        clock_type::time_point const expire = ttl.count() > 0 ? clock_type::now() + ttl
+                                                              : clock_type::time_point::max();
+        return get_shard(key).put(key, value, charge, expire);
+    }
+
+    bool remove(Key const &key)
+    {
+        return get_shard(key).remove(key);
+    }
+
+    // 主动清理所有过期元素，返回清理的个数
+    std::size_t purge_expired()
+    {
+        clock_type::time_point const now = clock_type::now();
+        std::size_t count = 0;
+        for (unsigned i = 0; i < shards.size(); ++i)
+        {
+            count += shards[i]->purge_expired(now);
+        }
+        return count;
+    }
+
+    std::size_t size() const
+    {
+        std::size_t count = 0;
+        for (unsigned i = 0; i < shards.size(); ++i)
+        {
+            std::shared_lock<std::shared_mutex> lock(shards[i]->mutex);
+            count += shards[i]->entries.size();
+        }
+        return count;
+    }
+
+    std::size_t usage() const
+    {
+        std::size_t total = 0;
+        for (unsigned i = 0; i < shards.size(); ++i)
+        {
+            std::shared_lock<std::shared_mutex> lock(shards[i]->mutex);
+            total += shards[i]->usage;
+        }
+        return total;
+    }
+
+    cache_stats stats() const
+    {
+        cache_stats res;
+        for (unsigned i = 0; i < shards.size(); ++i)
+        {
+            res.hits += shards[i]->hits.load(std::memory_order_relaxed);
+            res.misses += shards[i]->misses.load(std::memory_order_relaxed);
+            res.evictions += shards[i]->evictions.load(std::memory_order_relaxed);
+            res.expirations += shards[i]->expirations.load(std::memory_order_relaxed);
+        }
+        return res;
+    }
+};
+
+/* 测试 */
+void TestThreadSafeCache()
+{
+    // 总容量 100 个元素，分成 4 个分片
+    threadsafe_lru_cache<int, std::shared_ptr<int>> cache(100, 4);
+    int const hot = 10;
+    for (int i = 0; i < hot; i++)
+    {
+        cache.put(i, std::make_shared<int>(i));
+    }
+
+    std::atomic<bool> writing{true};
+    std::atomic<int> rounds{0};
+    std::thread writer([&]()
+                       {
+        for (int i = hot; i < 1000; i++)
+        {
+            // 每写入 10 个等读者读完一轮，相对每个分片 25 的容量，时钟指针转一圈之前热点 key 都会被再次访问
+            if (i % 10 == 0)
+            {
+                int const seen = rounds;
+                while (rounds == seen)
+                {
+                    std::this_thread::yield();
+                }
+            }
+            cache.put(i, std::make_shared<int>(i));
+        }
+        writing = false; });
+
+    std::thread reader([&]()
+                       {
+        // 写者扫描期间反复读取前 10 个 key，它们的访问标记会一直被置位，时钟指针经过时不会被淘汰
+        while (writing)
+        {
+            for (int i = 0; i < hot; i++)
+            {
+                cache.value_for(i, nullptr);
+            }
+            ++rounds;
+            std::this_thread::yield();
+        } });
+
+    writer.join();
+    reader.join();
+
+    int kept = 0;
+    for (int i = 0; i < hot; i++)
+    {
+        if (cache.value_for(i, nullptr))
+        {
+            kept++;
+        }
+    }
+    std::cout << "hot keys kept " << kept << " of " << hot << std::endl;
+    assert(kept == hot);
+
+    // 带过期时间的元素
+    cache.put(-1, std::make_shared<int>(-1), 1, std::chrono::milliseconds(50));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if (!cache.value_for(-1, nullptr))
+    {
+        std::cout << "key -1 expired" << std::endl;
+    }
+    cache.purge_expired();
+
+    auto st = cache.stats();
+    std::cout << "size is " << cache.size() << ", usage is " << cache.usage() << std::endl;
+    std::cout << "hits " << st.hits << " misses " << st.misses
+              << " evictions " << st.evictions << " expirations " << st.expirations << std::endl;
+}
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <iostream>
 #include <set>
 #include <thread>
@@ -8,6 +10,24 @@
 #include <shared_mutex>
 #include <iterator>
 #include <map>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <atomic>
+#include <cstring>
+#include <type_traits>
+
+// 透明哈希，std::string 作为 key 时可以直接用 string_view 或字符串字面量查找，不需要构造临时 string
+// 标准保证 std::hash<std::string> 与 std::hash<std::string_view> 对相同字符序列的结果相同
+struct string_hash
+{
+    typedef void is_transparent;
+    std::size_t operator()(std::string_view str) const
+    {
+        return std::hash<std::string_view>()(str);
+    }
+};
 
 template <typename Key, typename Value, typename Hash = std::hash<Key>>
 class threadsafe_lookup_table
@@ -30,7 +50,9 @@ private:
         // 改用共享锁
         mutable std::shared_mutex mutex;
         // 查找操作，在list中找到匹配的key值，然后返回迭代器
-        bucket_iterator find_entry_for(const Key &key)
+        // 模板化是为了支持异构查找，K 只要能与 Key 做 == 比较即可
+        template <typename K>
+        bucket_iterator find_entry_for(const K &key)
         {
             return std::find_if(data.begin(), data.end(),
                                 [&](bucket_value const &item)
@@ -59,8 +81,50 @@ private:
                 found_entry->second = value;
             }
         }
+        // 在独占锁下对value做读-改-写，key不存在时先插入默认构造的value
+        template <typename Function>
+        auto compute(Key const &key, Function &&f) -> decltype(f(std::declval<Value &>()))
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            bucket_iterator found_entry = find_entry_for(key);
+            if (found_entry == data.end())
+            {
+                data.emplace_back(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple());
+                found_entry = std::prev(data.end());
+            }
+            return f(found_entry->second);
+        }
+        // key不存在时用args原地构造value，存在则什么都不做，返回是否插入
+        template <typename... Args>
+        bool try_emplace(Key const &key, Args &&...args)
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            if (find_entry_for(key) != data.end())
+            {
+                return false;
+            }
+            data.emplace_back(std::piecewise_construct, std::forward_as_tuple(key),
+                              std::forward_as_tuple(std::forward<Args>(args)...));
+            return true;
+        }
+        // 在共享锁下访问value，避免拷贝，返回是否找到
+        template <typename K, typename Function>
+        bool with_value(K const &key, Function &&f) const
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            auto const found_entry = std::find_if(data.begin(), data.end(),
+                                                  [&](bucket_value const &item)
+                                                  { return item.first == key; });
+            if (found_entry == data.end())
+            {
+                return false;
+            }
+            f(found_entry->second);
+            return true;
+        }
         // 删除对应的key
-        void remove_mapping(Key const &key)
+        template <typename K>
+        void remove_mapping(K const &key)
         {
             std::unique_lock<std::shared_mutex> lock(mutex);
             bucket_iterator const found_entry = find_entry_for(key);
@@ -76,7 +140,8 @@ private:
     Hash hasher;
 
     // 根据key生成数字，并对桶的大小取余得到下标，根据下标返回对应的桶智能指针
-    bucket_type &get_bucket(Key const &key) const
+    template <typename K>
+    bucket_type &get_bucket(K const &key) const
     {
         std::size_t const bucket_index = hasher(key) % buckets.size();
         return *buckets[bucket_index];
@@ -112,6 +177,66 @@ public:
         get_bucket(key).remove_mapping(key);
     }
 
+    // 异构查找版本，仅当 Hash 定义了 is_transparent 时可用，如 string_hash
+    // 与上面的 value_for 保持相同的 const 限定，否则非 const 的表上 value_for("a") 会有二义性
+    template <typename K, typename H = Hash, typename = typename H::is_transparent>
+    Value value_for(K const &key, Value const &default_value = Value())
+    {
+        Value res = default_value;
+        get_bucket(key).with_value(key, [&](Value const &value)
+                                   { res = value; });
+        return res;
+    }
+
+    template <typename K, typename H = Hash, typename = typename H::is_transparent>
+    void remove_mapping(K const &key)
+    {
+        get_bucket(key).remove_mapping(key);
+    }
+
+    // 在桶的独占锁下执行 f(Value&)，一次加锁完成读-改-写，返回 f 的返回值
+    // key 不存在时先插入默认构造的 Value
+    template <typename Function>
+    auto compute(Key const &key, Function f) -> decltype(f(std::declval<Value &>()))
+    {
+        return get_bucket(key).compute(key, f);
+    }
+
+    // key 不存在时用 args 原地构造 Value，返回是否插入成功
+    template <typename... Args>
+    bool try_emplace(Key const &key, Args &&...args)
+    {
+        return get_bucket(key).try_emplace(key, std::forward<Args>(args)...);
+    }
+
+    // 在桶的共享锁下执行 f(Value const&)，不拷贝 Value，返回 key 是否存在
+    template <typename Function>
+    bool with_value(Key const &key, Function f) const
+    {
+        return get_bucket(key).with_value(key, f);
+    }
+
+    template <typename K, typename Function, typename H = Hash, typename = typename H::is_transparent>
+    bool with_value(K const &key, Function f) const
+    {
+        return get_bucket(key).with_value(key, f);
+    }
+
+    // 逐个桶在共享锁下遍历所有元素，不会像 get_map 那样同时锁住所有桶，
+    // 写者只会在当前正在遍历的桶上被阻塞，代价是结果不是某一时刻的一致快照
+    template <typename Function>
+    void for_each(Function f) const
+    {
+        for (unsigned i = 0; i < buckets.size(); ++i)
+        {
+            std::shared_lock<std::shared_mutex> lock(buckets[i]->mutex);
+            for (auto const &item : buckets[i]->data)
+            {
+                f(item.first, item.second);
+            }
+        }
+    }
+
     std::map<Key, Value> get_map()
     {
         std::vector<std::unique_lock<std::shared_mutex>> locks;
@@ -135,6 +260,295 @@ public:
     }
 };
 
+/*
+ * 条带化 + 顺序锁(seqlock)版本的查找表，适合读多写少的场景
+ * 1. 所有条带放在一个连续的 vector 中，每个条带对齐到缓存行，相邻条带的锁和版本号不会伪共享
+ * 2. 每个条带内部是开放寻址的槽位数组，写者持有条带的互斥锁，修改前后各把版本号加一（奇数表示正在写）
+ * 3. 读者不加锁也不做原子读-改-写：先读版本号，再拷贝槽位数据，最后确认版本号没变，变了就重试
+ * 4. 扩容时旧的槽位数组不立即释放，而是挂在条带上直到析构，保证乐观读者读到的内存始终有效，
+ *    由于每次扩容容量翻倍，保留的旧数组总大小不超过当前数组大小
+ * 读者可能拷贝到写了一半的数据，所以 Key 和 Value 必须是可平凡拷贝的类型
+ */
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class seqlock_lookup_table
+{
+    static_assert(std::is_trivially_copyable<Key>::value, "Key must be trivially copyable");
+    static_assert(std::is_trivially_copyable<Value>::value, "Value must be trivially copyable");
+
+private:
+    enum slot_state : unsigned char
+    {
+        slot_empty = 0,
+        slot_full = 1,
+        slot_deleted = 2
+    };
+
+    struct slot_type
+    {
+        std::atomic<unsigned char> state{slot_empty};
+        Key key;
+        Value value;
+    };
+
+    // 槽位数组，容量为 2 的幂，构造后大小不再变化
+    struct slot_array
+    {
+        std::vector<slot_type> slots;
+        std::size_t mask;
+        explicit slot_array(std::size_t capacity) : slots(capacity), mask(capacity - 1)
+        {
+        }
+    };
+
+    // 条带类型
+    struct alignas(64) stripe_type
+    {
+        std::atomic<unsigned> version{0};
+        std::atomic<slot_array *> table{nullptr};
+        // 只在写者之间互斥
+        std::mutex mutex;
+        std::size_t size = 0;
+        std::size_t used = 0; // 包含删除标记的槽位数
+        // 当前数组和扩容后保留的旧数组
+        std::vector<std::unique_ptr<slot_array>> arrays;
+    };
+
+    std::vector<stripe_type> stripes;
+    Hash hasher;
+
+    stripe_type &get_stripe(std::size_t hash_value) const
+    {
+        return const_cast<stripe_type &>(stripes[hash_value % stripes.size()]);
+    }
+
+    // 条带内的起始槽位，除掉条带数避免同一条带的 key 聚集在相同的槽位
+    std::size_t slot_index(std::size_t hash_value, slot_array const &arr) const
+    {
+        return (hash_value / stripes.size()) & arr.mask;
+    }
+
+    // 写者进入临界区，版本号变成奇数
+    static void write_begin(stripe_type &stripe)
+    {
+        stripe.version.store(stripe.version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    // 写者离开临界区，版本号变回偶数
+    static void write_end(stripe_type &stripe)
+    {
+        stripe.version.store(stripe.version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // 调用方持有条带的锁，返回 key 所在的槽位，不存在返回 nullptr
+    slot_type *find_slot_locked(slot_array &arr, std::size_t hash_value, Key const &key) const
+    {
+        std::size_t index = slot_index(hash_value, arr);
+        for (std::size_t probe = 0; probe <= arr.mask; ++probe)
+        {
+            slot_type &slot = arr.slots[(index + probe) & arr.mask];
+            unsigned char const state = slot.state.load(std::memory_order_relaxed);
+            if (state == slot_empty)
+            {
+                return nullptr;
+            }
+            if (state == slot_full && slot.key == key)
+            {
+                return &slot;
+            }
+        }
+        return nullptr;
+    }
+
+    // 调用方持有条带的锁且已进入写临界区，把 key 放进第一个可用的槽位
+    void insert_locked(stripe_type &stripe, slot_array &arr, std::size_t hash_value, Key const &key, Value const &value)
+    {
+        std::size_t index = slot_index(hash_value, arr);
+        for (std::size_t probe = 0; probe <= arr.mask; ++probe)
+        {
+            slot_type &slot = arr.slots[(index + probe) & arr.mask];
+            unsigned char const state = slot.state.load(std::memory_order_relaxed);
+            if (state != slot_full)
+            {
+                if (state == slot_empty)
+                {
+                    ++stripe.used;
+                }
+                slot.key = key;
+                slot.value = value;
+                slot.state.store(slot_full, std::memory_order_relaxed);
+                ++stripe.size;
+                return;
+            }
+        }
+    }
+
+    // 调用方持有条带的锁且已进入写临界区，负载过高时重建槽位数组
+    // 有效元素多则换成容量翻倍的新数组，否则原地重建以清理删除标记
+    // 原地重建时读者可能读到中间状态，但版本号是奇数，读者一定会重试
+    void rehash_locked(stripe_type &stripe)
+    {
+        slot_array *old_arr = stripe.table.load(std::memory_order_relaxed);
+        std::size_t const capacity = old_arr->slots.size();
+        if ((stripe.used + 1) * 4 <= capacity * 3)
+        {
+            return;
+        }
+        std::vector<std::pair<Key, Value>> items;
+        items.reserve(stripe.size);
+        for (slot_type &slot : old_arr->slots)
+        {
+            if (slot.state.load(std::memory_order_relaxed) == slot_full)
+            {
+                items.push_back(std::make_pair(slot.key, slot.value));
+            }
+            slot.state.store(slot_empty, std::memory_order_relaxed);
+        }
+        slot_array *new_arr = old_arr;
+        if ((items.size() + 1) * 2 > capacity)
+        {
+            stripe.arrays.emplace_back(new slot_array(capacity * 2));
+            new_arr = stripe.arrays.back().get();
+        }
+        stripe.size = 0;
+        stripe.used = 0;
+        for (auto const &item : items)
+        {
+            insert_locked(stripe, *new_arr, hasher(item.first), item.first, item.second);
+        }
+        stripe.table.store(new_arr, std::memory_order_release);
+    }
+
+public:
+    seqlock_lookup_table(unsigned num_stripes = 19, std::size_t initial_capacity = 16, Hash const &hasher_ = Hash())
+        : stripes(num_stripes == 0 ? 1 : num_stripes), hasher(hasher_)
+    {
+        std::size_t capacity = 2;
+        while (capacity < initial_capacity)
+        {
+            capacity *= 2;
+        }
+        for (stripe_type &stripe : stripes)
+        {
+            stripe.arrays.emplace_back(new slot_array(capacity));
+            stripe.table.store(stripe.arrays.back().get(), std::memory_order_relaxed);
+        }
+    }
+
+    seqlock_lookup_table(seqlock_lookup_table const &other) = delete;
+    seqlock_lookup_table &operator=(seqlock_lookup_table const &other) = delete;
+
+    // 乐观读，找到返回 true 并把值拷贝到 value
+    bool find(Key const &key, Value &value) const
+    {
+        std::size_t const hash_value = hasher(key);
+        stripe_type &stripe = get_stripe(hash_value);
+        for (;;)
+        {
+            unsigned const begin_version = stripe.version.load(std::memory_order_acquire);
+            if (begin_version & 1)
+            {
+                // 写者正在修改，稍后重试
+                std::this_thread::yield();
+                continue;
+            }
+            slot_array const *arr = stripe.table.load(std::memory_order_acquire);
+            std::size_t const index = slot_index(hash_value, *arr);
+            bool found = false;
+            for (std::size_t probe = 0; probe <= arr->mask; ++probe)
+            {
+                slot_type const &slot = arr->slots[(index + probe) & arr->mask];
+                unsigned char const state = slot.state.load(std::memory_order_relaxed);
+                if (state == slot_empty)
+                {
+                    break;
+                }
+                if (state != slot_full)
+                {
+                    continue;
+                }
+                // 先拷贝到局部变量再比较，避免对可能被改写的内存做多次读取
+                Key slot_key;
+                std::memcpy(static_cast<void *>(&slot_key), &slot.key, sizeof(Key));
+                if (slot_key == key)
+                {
+                    std::memcpy(static_cast<void *>(&value), &slot.value, sizeof(Value));
+                    found = true;
+                    break;
+                }
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (stripe.version.load(std::memory_order_relaxed) == begin_version)
+            {
+                return found;
+            }
+        }
+    }
+
+    Value value_for(Key const &key, Value const &default_value = Value()) const
+    {
+        Value value;
+        return find(key, value) ? value : default_value;
+    }
+
+    void add_or_update_mapping(Key const &key, Value const &value)
+    {
+        std::size_t const hash_value = hasher(key);
+        stripe_type &stripe = get_stripe(hash_value);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        write_begin(stripe);
+        slot_array *arr = stripe.table.load(std::memory_order_relaxed);
+        if (slot_type *slot = find_slot_locked(*arr, hash_value, key))
+        {
+            slot->value = value;
+        }
+        else
+        {
+            rehash_locked(stripe);
+            insert_locked(stripe, *stripe.table.load(std::memory_order_relaxed), hash_value, key, value);
+        }
+        write_end(stripe);
+    }
+
+    void remove_mapping(Key const &key)
+    {
+        std::size_t const hash_value = hasher(key);
+        stripe_type &stripe = get_stripe(hash_value);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        slot_array *arr = stripe.table.load(std::memory_order_relaxed);
+        slot_type *slot = find_slot_locked(*arr, hash_value, key);
+        if (slot == nullptr)
+        {
+            return;
+        }
+        write_begin(stripe);
+        slot->state.store(slot_deleted, std::memory_order_relaxed);
+        --stripe.size;
+        write_end(stripe);
+    }
+
+    std::map<Key, Value> get_map() const
+    {
+        std::vector<std::unique_lock<std::mutex>> locks;
+        for (stripe_type const &stripe : stripes)
+        {
+            locks.push_back(std::unique_lock<std::mutex>(const_cast<stripe_type &>(stripe).mutex));
+        }
+        std::map<Key, Value> res;
+        for (stripe_type const &stripe : stripes)
+        {
+            for (slot_type const &slot : stripe.table.load(std::memory_order_relaxed)->slots)
+            {
+                if (slot.state.load(std::memory_order_relaxed) == slot_full)
+                {
+                    res.insert(std::make_pair(slot.key, slot.value));
+                }
+            }
+        }
+        return res;
+    }
+};
+
 /* 测试 */
 class MyClass
 {
@@ -203,4 +617,82 @@ void TestThreadSafeHash()
     {
         std::cout << "copy data is " << *(i.second) << std::endl;
     }
-}
\ No newline at end of file
+}
+void TestThreadSafeHashCompute()
+{
+    threadsafe_lookup_table<std::string, std::vector<int>, string_hash> table;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+    {
+        threads.emplace_back([&table, t]()
+                             {
+            for (int i = 0; i < 100; i++)
+            {
+                // 一次加锁完成追加，不需要 value_for + add_or_update_mapping 两次往返
+                table.compute("even", [&](std::vector<int> &vec)
+                              { if (i % 2 == 0) vec.push_back(t * 100 + i); });
+                table.compute("odd", [&](std::vector<int> &vec)
+                              { if (i % 2 != 0) vec.push_back(t * 100 + i); });
+            } });
+    }
+    for (auto &th : threads)
+    {
+        th.join();
+    }
+
+    // 已存在时不会覆盖
+    table.try_emplace("even", 3, 0);
+    table.try_emplace("zero", 3, 0);
+
+    // 用 string_view 查找，不会构造临时 std::string
+    std::string_view key("even");
+    table.with_value(key, [](std::vector<int> const &vec)
+                     { std::cout << "even size is " << vec.size() << std::endl; });
+    table.with_value("odd", [](std::vector<int> const &vec)
+                     { std::cout << "odd size is " << vec.size() << std::endl; });
+    std::cout << "zero size is " << table.value_for(std::string_view("zero")).size() << std::endl;
+}
+
+void TestSeqlockLookupTable()
+{
+    seqlock_lookup_table<int, long> table;
+    std::atomic<bool> done{false};
+
+    std::thread writer([&]()
+                       {
+        for (int round = 0; round < 10; round++)
+        {
+            for (int i = 0; i < 1000; i++)
+            {
+                table.add_or_update_mapping(i, static_cast<long>(i) * 2);
+            }
+            for (int i = 0; i < 1000; i += 2)
+            {
+                table.remove_mapping(i);
+            }
+        }
+        done = true; });
+
+    std::thread reader([&]()
+                       {
+        long bad = 0;
+        while (!done)
+        {
+            for (int i = 0; i < 1000; i++)
+            {
+                long value = 0;
+                // 读到的一定是完整写入的值，不会是写了一半的数据
+                if (table.find(i, value) && value != static_cast<long>(i) * 2)
+                {
+                    bad++;
+                }
+            }
+        }
+        std::cout << "reader bad value count is " << bad << std::endl; });
+
+    writer.join();
+    reader.join();
+
+    auto copy_map = table.get_map();
+    std::cout << "seqlock table size is " << copy_map.size() << std::endl;
+}
@@ -0,0 +1,452 @@
+#pragma once
+
+#include "ThreadSafeHash.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * threadsafe_lookup_table 的磁盘快照与热启动
+ * 文件格式（小端、本机字长，只保证同一程序在同一平台上读写）：
+ *   snapshot_header
+ *   uint64_t slots[slot_count]  开放寻址的索引，保存记录在文件中的偏移，0 表示空槽
+ *   记录区                        每条记录是编码后的 key 紧跟编码后的 value
+ * 索引按 Hash 计算槽位，所以加载快照时必须使用与保存时相同的 Hash
+ */
+
+// 编解码，可平凡拷贝的类型直接按字节保存
+template <typename T, typename Enable = void>
+struct snapshot_codec;
+
+template <typename T>
+struct snapshot_codec<T, typename std::enable_if<std::is_trivially_copyable<T>::value>::type>
+{
+    static void write(std::string &out, T const &value)
+    {
+        out.append(reinterpret_cast<char const *>(&value), sizeof(T));
+    }
+    static bool read(char const *&pos, char const *end, T &value)
+    {
+        if (static_cast<std::size_t>(end - pos) < sizeof(T))
+            return false;
+        std::memcpy(static_cast<void *>(&value), pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+};
+
+// 字符串保存为 uint32_t 长度 + 字节
+template <>
+struct snapshot_codec<std::string>
+{
+    static void write(std::string &out, std::string const &value)
+    {
+        std::uint32_t const len = static_cast<std::uint32_t>(value.size());
+        snapshot_codec<std::uint32_t>::write(out, len);
+        out.append(value);
+    }
+    static bool read(char const *&pos, char const *end, std::string &value)
+    {
+        std::uint32_t len = 0;
+        if (!snapshot_codec<std::uint32_t>::read(pos, end, len) || static_cast<std::size_t>(end - pos) < len)
+            return false;
+        value.assign(pos, len);
+        pos += len;
+        return true;
+    }
+};
+
+// shared_ptr 先保存一个字节表示是否为空，再保存指向的对象
+template <typename T>
+struct snapshot_codec<std::shared_ptr<T>>
+{
+    static void write(std::string &out, std::shared_ptr<T> const &value)
+    {
+        std::uint8_t const present = value ? 1 : 0;
+        snapshot_codec<std::uint8_t>::write(out, present);
+        if (value)
+            snapshot_codec<T>::write(out, *value);
+    }
+    static bool read(char const *&pos, char const *end, std::shared_ptr<T> &value)
+    {
+        std::uint8_t present = 0;
+        if (!snapshot_codec<std::uint8_t>::read(pos, end, present))
+            return false;
+        if (!present)
+        {
+            value.reset();
+            return true;
+        }
+        T inner;
+        if (!snapshot_codec<T>::read(pos, end, inner))
+            return false;
+        value = std::make_shared<T>(std::move(inner));
+        return true;
+    }
+};
+
+struct snapshot_header
+{
+    char magic[8];
+    std::uint64_t entry_count;
+    std::uint64_t slot_count;
+};
+
+static char const snapshot_magic[8] = {'T', 'S', 'L', 'T', 'S', 'N', 'P', '1'};
+
+/*
+ * 把查找表写到 path，写者不需要停下来：逐个桶在共享锁下拷贝，
+ * 先写临时文件再 rename，进程崩溃也不会留下写了一半的快照
+ */
+template <typename Key, typename Value, typename Hash>
+bool save_snapshot(threadsafe_lookup_table<Key, Value, Hash> const &table, std::string const &path,
+                   Hash const &hasher = Hash())
+{
+    std::string records;
+    std::vector<std::pair<std::size_t, std::uint64_t>> entries; // 哈希值，记录在记录区中的偏移
+    table.for_each([&](Key const &key, Value const &value)
+                   {
+        entries.emplace_back(hasher(key), records.size());
+        snapshot_codec<Key>::write(records, key);
+        snapshot_codec<Value>::write(records, value); });
+
+    // 索引容量取不小于两倍元素个数的 2 的幂，负载因子不超过 0.5
+    std::uint64_t slot_count = 1;
+    while (slot_count < entries.size() * 2)
+    {
+        slot_count *= 2;
+    }
+    std::uint64_t const records_offset = sizeof(snapshot_header) + slot_count * sizeof(std::uint64_t);
+    std::vector<std::uint64_t> slots(slot_count, 0);
+    for (auto const &entry : entries)
+    {
+        std::uint64_t index = entry.first & (slot_count - 1);
+        while (slots[index] != 0)
+        {
+            index = (index + 1) & (slot_count - 1);
+        }
+        slots[index] = records_offset + entry.second;
+    }
+
+    snapshot_header header;
+    std::memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+    header.entry_count = entries.size();
+    header.slot_count = slot_count;
+
+    std::string const tmp_path = path + ".tmp";
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        if (!out)
+            return false;
+        out.write(reinterpret_cast<char const *>(&header), sizeof(header));
+        out.write(reinterpret_cast<char const *>(slots.data()), slots.size() * sizeof(std::uint64_t));
+        out.write(records.data(), records.size());
+        if (!out)
+            return false;
+    }
+    return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+/* 只读的内存映射快照，打开后无需反序列化即可按 key 查找 */
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class lookup_table_snapshot
+{
+public:
+    explicit lookup_table_snapshot(Hash const &hasher_ = Hash()) : hasher(hasher_) {}
+
+    ~lookup_table_snapshot()
+    {
+        close();
+    }
+
+    lookup_table_snapshot(lookup_table_snapshot const &other) = delete;
+    lookup_table_snapshot &operator=(lookup_table_snapshot const &other) = delete;
+
+    // 映射快照文件，文件不存在或格式不对返回 false
+    bool open(std::string const &path)
+    {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(snapshot_header))
+        {
+            ::close(fd);
+            return false;
+        }
+        void *addr = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        // 映射建立后文件描述符就可以关闭了
+        ::close(fd);
+        if (addr == MAP_FAILED)
+            return false;
+        base = static_cast<char const *>(addr);
+        length = st.st_size;
+
+        std::memcpy(&header, base, sizeof(header));
+        if (std::memcmp(header.magic, snapshot_magic, sizeof(header.magic)) != 0 ||
+            header.slot_count == 0 || (header.slot_count & (header.slot_count - 1)) != 0 ||
+            sizeof(snapshot_header) + header.slot_count * sizeof(std::uint64_t) > length)
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if (base != nullptr)
+        {
+            ::munmap(const_cast<char *>(base), length);
+            base = nullptr;
+            length = 0;
+        }
+    }
+
+    bool is_open() const
+    {
+        return base != nullptr;
+    }
+
+    std::size_t size() const
+    {
+        return is_open() ? header.entry_count : 0;
+    }
+
+    // 直接在映射的内存上按索引查找，只解码命中的记录
+    bool find(Key const &key, Value &value) const
+    {
+        if (!is_open())
+            return false;
+        std::uint64_t const mask = header.slot_count - 1;
+        std::uint64_t index = hasher(key) & mask;
+        for (std::uint64_t probe = 0; probe < header.slot_count; ++probe)
+        {
+            std::uint64_t const offset = slot_at((index + probe) & mask);
+            if (offset == 0)
+                return false;
+            Key stored_key;
+            char const *pos = base + offset;
+            if (!decode_key(offset, stored_key, pos))
+                return false;
+            if (stored_key == key)
+                return snapshot_codec<Value>::read(pos, base + length, value);
+        }
+        return false;
+    }
+
+    // 按索引顺序解码所有记录
+    template <typename Function>
+    void for_each(Function f) const
+    {
+        if (!is_open())
+            return;
+        for (std::uint64_t i = 0; i < header.slot_count; ++i)
+        {
+            std::uint64_t const offset = slot_at(i);
+            if (offset == 0)
+                continue;
+            Key key;
+            Value value;
+            char const *pos = base + offset;
+            if (decode_key(offset, key, pos) && snapshot_codec<Value>::read(pos, base + length, value))
+                f(key, value);
+        }
+    }
+
+private:
+    std::uint64_t slot_at(std::uint64_t index) const
+    {
+        std::uint64_t offset = 0;
+        std::memcpy(&offset, base + sizeof(snapshot_header) + index * sizeof(std::uint64_t), sizeof(offset));
+        return offset;
+    }
+
+    bool decode_key(std::uint64_t offset, Key &key, char const *&pos) const
+    {
+        if (offset >= length)
+            return false;
+        return snapshot_codec<Key>::read(pos, base + length, key);
+    }
+
+    Hash hasher;
+    char const *base = nullptr;
+    std::size_t length = 0;
+    snapshot_header header{};
+};
+
+/*
+ * 热启动的查找表：启动时映射快照立即提供读服务，内存中的 threadsafe_lookup_table 逐步重建
+ * 1. 读取先查内存表，未命中再查快照，快照命中的元素用 try_emplace 提升到内存表，不会覆盖更新的写入
+ * 2. 删除的 key 记录在墓碑表中，防止被快照中的旧值复活
+ * 3. rebuild() 把快照中剩余的元素全部导入内存表，之后解除映射，后续访问与普通查找表完全相同
+ * 删除与提升用按哈希条带化的互斥锁串行化，保证"检查墓碑 + 插入"与"记录墓碑 + 删除"不会交错
+ */
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class warm_lookup_table
+{
+public:
+    explicit warm_lookup_table(std::string const &snapshot_path, unsigned num_buckets = 19, Hash const &hasher_ = Hash())
+        : table(num_buckets, hasher_), tombstones(num_buckets, hasher_), snapshot(hasher_), hasher(hasher_)
+    {
+        active = snapshot.open(snapshot_path);
+    }
+
+    warm_lookup_table(warm_lookup_table const &other) = delete;
+    warm_lookup_table &operator=(warm_lookup_table const &other) = delete;
+
+    Value value_for(Key const &key, Value const &default_value = Value())
+    {
+        Value res;
+        if (table.with_value(key, [&](Value const &value)
+                             { res = value; }))
+        {
+            return res;
+        }
+        return promote(key, res) ? res : default_value;
+    }
+
+    void add_or_update_mapping(Key const &key, Value const &value)
+    {
+        table.add_or_update_mapping(key, value);
+    }
+
+    void remove_mapping(Key const &key)
+    {
+        std::lock_guard<std::mutex> lock(stripe_for(key));
+        if (active.load(std::memory_order_acquire))
+        {
+            tombstones.add_or_update_mapping(key, true);
+        }
+        table.remove_mapping(key);
+    }
+
+    // 把快照剩余的元素全部导入内存表，可以放在后台线程执行
+    void rebuild()
+    {
+        std::shared_lock<std::shared_mutex> snapshot_lock(snapshot_mutex);
+        if (!active.load(std::memory_order_acquire))
+            return;
+        snapshot.for_each([this](Key const &key, Value const &value)
+                          {
+            std::lock_guard<std::mutex> lock(stripe_for(key));
+            if (!tombstones.value_for(key, false))
+            {
+                table.try_emplace(key, value);
+            } });
+        snapshot_lock.unlock();
+
+        // 导入完成后快照和墓碑都不再需要
+        std::unique_lock<std::shared_mutex> close_lock(snapshot_mutex);
+        if (active.exchange(false))
+        {
+            snapshot.close();
+            std::vector<Key> removed;
+            tombstones.for_each([&](Key const &key, bool)
+                                { removed.push_back(key); });
+            for (auto const &key : removed)
+            {
+                tombstones.remove_mapping(key);
+            }
+        }
+    }
+
+    bool warming() const
+    {
+        return active.load(std::memory_order_acquire);
+    }
+
+    // 保存前先完成重建，保证快照里没有的元素不会丢失
+    bool save(std::string const &path)
+    {
+        rebuild();
+        return save_snapshot(table, path, hasher);
+    }
+
+    threadsafe_lookup_table<Key, Value, Hash> &underlying()
+    {
+        return table;
+    }
+
+private:
+    static constexpr std::size_t stripe_count = 64;
+
+    std::mutex &stripe_for(Key const &key)
+    {
+        return stripes[hasher(key) % stripe_count];
+    }
+
+    // 从快照中查找 key 并提升到内存表
+    bool promote(Key const &key, Value &res)
+    {
+        if (!active.load(std::memory_order_acquire))
+            return false;
+        std::shared_lock<std::shared_mutex> snapshot_lock(snapshot_mutex);
+        if (!active.load(std::memory_order_acquire))
+            return false;
+        Value value;
+        if (!snapshot.find(key, value))
+            return false;
+        std::lock_guard<std::mutex> lock(stripe_for(key));
+        if (tombstones.value_for(key, false))
+            return false;
+        table.try_emplace(key, value);
+        // 提升期间可能有更新的写入，以内存表为准
+        return table.with_value(key, [&](Value const &current)
+                                { res = current; });
+    }
+
+    threadsafe_lookup_table<Key, Value, Hash> table;
+    threadsafe_lookup_table<Key, bool, Hash> tombstones;
+    lookup_table_snapshot<Key, Value, Hash> snapshot;
+    Hash hasher;
+    std::atomic<bool> active{false};
+    // 保护快照的映射，rebuild 结束时独占锁下解除映射
+    std::shared_mutex snapshot_mutex;
+    std::mutex stripes[stripe_count];
+};
+
+/* 测试 */
+void TestLookupTableSnapshot()
+{
+    std::string const path = "lookup_table.snapshot";
+    {
+        threadsafe_lookup_table<int, std::string> table;
+        for (int i = 0; i < 1000; i++)
+        {
+            table.add_or_update_mapping(i, "value " + std::to_string(i));
+        }
+        // 保存的同时仍然有线程在写
+        std::thread writer([&]()
+                           {
+            for (int i = 1000; i < 2000; i++)
+            {
+                table.add_or_update_mapping(i, "value " + std::to_string(i));
+            } });
+        save_snapshot(table, path);
+        writer.join();
+    }
+
+    // 模拟重启，映射快照后立即可读
+    warm_lookup_table<int, std::string> warm(path);
+    std::cout << "warming " << warm.warming() << ", key 10 is " << warm.value_for(10) << std::endl;
+    warm.remove_mapping(20);
+    warm.add_or_update_mapping(30, "new value 30");
+
+    std::thread loader([&]()
+                       { warm.rebuild(); });
+    loader.join();
+
+    std::cout << "warming " << warm.warming() << ", key 20 is '" << warm.value_for(20)
+              << "', key 30 is " << warm.value_for(30) << std::endl;
+    std::remove(path.c_str());
+}
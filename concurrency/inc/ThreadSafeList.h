@@ -1,21 +1,43 @@
 #include <mutex>
+#include <shared_mutex>
 #include <memory>
+#include <atomic>
+#include <vector>
+#include <future>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
 #include "global.h"
+#include "NodePool.h"
+#include "ThreadPool.h"
 
 template <typename T>
 class double_push_list
 {
     struct node_d
     {
-        std::mutex m;
+        // 写操作加独占锁，只读遍历加共享锁，多个只读遍历可以并行
+        mutable std::shared_mutex m;
+        // 元素和 shared_ptr 的控制块一起从节点池分配，find_first_if 返回的指针与链表共享同一个元素
         std::shared_ptr<T> data;
         std::unique_ptr<node_d> next;
+        // 被并行批量操作选作分段边界时钉住，钉住的节点不能被删除
+        std::atomic<int> pins{0};
         node_d() : next()
         {
         }
-        node_d(T const &value) : data(std::make_shared<T>(value))
+        node_d(T const &value) : data(std::allocate_shared<T>(node_pool_allocator<T>(), value))
         {
         }
+        // 节点从按线程缓存的节点池分配，插入和删除都不访问全局堆
+        static void *operator new(std::size_t)
+        {
+            return node_pool<node_d>::allocate();
+        }
+        static void operator delete(void *ptr)
+        {
+            node_pool<node_d>::deallocate(ptr);
+        }
     };
 
     node_d head;
@@ -31,7 +53,7 @@ public:
 
     ~double_push_list()
     {
-        remove_if([](node_d const &)
+        remove_if([](T const &)
                   { return true; });
     }
 
@@ -41,7 +63,7 @@ public:
     void push_front(T const &value)
     {
         std::unique_ptr<node_d> new_node(new node_d(value));
-        std::lock_guard<std::mutex> lk(head.m);
+        std::lock_guard<std::shared_mutex> lk(head.m);
         new_node->next = std::move(head.next);
         head.next = std::move(new_node);
         // 更新最后一个节点
@@ -58,7 +80,7 @@ public:
         // 并且保证头部或者删除节点更新last_node_ptr唯一, 所以同时加锁
         std::unique_ptr<node_d> new_node(new node_d(value));
         std::lock(last_node_ptr->m, last_ptr_mtx);
-        std::unique_lock<std::mutex> lk(last_node_ptr->m, std::adopt_lock);
+        std::unique_lock<std::shared_mutex> lk(last_node_ptr->m, std::adopt_lock);
         std::unique_lock<std::mutex> last_lk(last_ptr_mtx, std::adopt_lock);
         // 原来的最后节点的下一个节点指向新生成的节点
         last_node_ptr->next = std::move(new_node);
@@ -70,10 +92,10 @@ public:
     void for_each(Function f)
     {
         node_d *current = &head;
-        std::unique_lock<std::mutex> lk(head.m);
+        std::unique_lock<std::shared_mutex> lk(head.m);
         while (node_d *const next = current->next.get())
         {
-            std::unique_lock<std::mutex> next_lk(next->m);
+            std::unique_lock<std::shared_mutex> next_lk(next->m);
             lk.unlock();
             f(*next->data);
             current = next;
@@ -81,16 +103,33 @@ public:
         }
     }
 
+    // 只读遍历，逐节点加共享锁（hand-over-hand），多个只读遍历之间互不阻塞
+    template <typename Function>
+    void for_each_shared(Function f) const
+    {
+        node_d const *current = &head;
+        std::shared_lock<std::shared_mutex> lk(head.m);
+        while (node_d const *const next = current->next.get())
+        {
+            std::shared_lock<std::shared_mutex> next_lk(next->m);
+            lk.unlock();
+            f(static_cast<T const &>(*next->data));
+            current = next;
+            lk = std::move(next_lk);
+        }
+    }
+
+    // 查找不修改元素，使用共享锁遍历
     template <typename Predicate>
-    std::shared_ptr<T> find_first_if(Predicate p)
+    std::shared_ptr<T> find_first_if(Predicate p) const
     {
-        node_d *current = &head;
-        std::unique_lock<std::mutex> lk(head.m);
-        while (node_d *const next = current->next.get())
+        node_d const *current = &head;
+        std::shared_lock<std::shared_mutex> lk(head.m);
+        while (node_d const *const next = current->next.get())
         {
-            std::unique_lock<std::mutex> next_lk(next->m);
+            std::shared_lock<std::shared_mutex> next_lk(next->m);
             lk.unlock();
-            if (p(*next->data))
+            if (p(static_cast<T const &>(*next->data)))
             {
                 return next->data;
             }
@@ -103,50 +142,31 @@ public:
     template <typename Predicate>
     void remove_if(Predicate p)
     {
-        node_d *current = &head;
-        std::unique_lock<std::mutex> lk(head.m);
-        while (node_d *const next = current->next.get())
-        {
-            std::unique_lock<std::mutex> next_lk(next->m);
-            if (p(*next->data))
-            {
-                std::unique_ptr<node_d> old_next = std::move(current->next);
-                current->next = std::move(next->next);
-                // 判断删除的是否为最后一个节点
-                if (current->next == nullptr)
-                {
-                    std::lock_guard<std::mutex> last_lk(last_ptr_mtx);
-                    last_node_ptr = current;
-                }
-                next_lk.unlock();
-            }
-            else
-            {
-                lk.unlock();
-                current = next;
-                lk = std::move(next_lk);
-            }
-        }
+        unlink_if([&](node_d &n)
+                  { return p(*n.data); });
     }
 
     template <typename Predicate>
     bool remove_first(Predicate p)
     {
         node_d *current = &head;
-        std::unique_lock<std::mutex> lk(head.m);
+        std::unique_lock<std::shared_mutex> lk(head.m);
         while (node_d *const next = current->next.get())
         {
-            std::unique_lock<std::mutex> next_lk(next->m);
+            std::unique_lock<std::shared_mutex> next_lk(next->m);
             if (p(*next->data))
             {
-                std::unique_ptr<node_d> old_next = std::move(current->next);
-                current->next = std::move(next->next);
-                // 判断删除的是否为最后一个节点
-                if (current->next == nullptr)
+                if (next->pins.load(std::memory_order_acquire) != 0)
                 {
-                    std::lock_guard<std::mutex> last_lk(last_ptr_mtx);
-                    last_node_ptr = current;
+                    // 节点是并行批量操作的分段边界，等它处理完再从头查找
+                    next_lk.unlock();
+                    lk.unlock();
+                    std::this_thread::yield();
+                    current = &head;
+                    lk = std::unique_lock<std::shared_mutex>(head.m);
+                    continue;
                 }
+                std::unique_ptr<node_d> old_next = unlink_next(current);
                 next_lk.unlock();
 
                 return true;
@@ -165,10 +185,10 @@ public:
     void insert_if(Predicate p, T const &value)
     {
         node_d *current = &head;
-        std::unique_lock<std::mutex> lk(head.m);
+        std::unique_lock<std::shared_mutex> lk(head.m);
         while (node_d *const next = current->next.get())
         {
-            std::unique_lock<std::mutex> next_lk(next->m);
+            std::unique_lock<std::shared_mutex> next_lk(next->m);
             if (p(*(next->data)))
             {
                 std::unique_ptr<node_d> new_node(new node_d(value));
@@ -187,6 +207,265 @@ public:
             lk = std::move(next_lk);
         }
     }
+
+    /*
+     * 并行遍历：链表按 segment_size 个节点切成若干段，每段交给线程池的一个任务，段内仍然逐节点加独占锁
+     * 1. 调用线程用共享锁走一遍链表，每隔 segment_size 个节点钉住一个分界点，分界点在批量操作结束前不会被删除，
+     *    所以每段的起点和终点始终在链表中；找到一个分界点就把它之前的一段投递出去，切分和处理同时进行
+     * 2. 分界点钉两次：一次给以它为起点的段，一次给以它为终点的段，两段都走到它之后才解除
+     * 3. 批量操作期间其他线程照常插入和删除，新插入的节点可能被处理也可能不被处理，与 for_each 相同
+     * f 抛出异常时所在的段停止，分界点照样解除钉住，其余段照常执行，全部结束后重新抛出第一个异常；
+     * 不要在线程池的任务里调用，否则可能等待排在自己后面的任务
+     */
+    template <typename Function>
+    void parallel_for_each(Function f, std::size_t segment_size = 4096)
+    {
+        run_segments([&f](node_d *start, node_d *stop)
+                     {
+            pin_guard start_pin(start->data ? start : nullptr);
+            pin_guard stop_pin(stop);
+            node_d *current = start;
+            std::unique_lock<std::shared_mutex> lk(current->m);
+            if (current->data)
+            {
+                f(*current->data);
+                start_pin.release();
+            }
+            while (node_d *const next = current->next.get())
+            {
+                if (next == stop)
+                {
+                    stop_pin.release();
+                    break;
+                }
+                std::unique_lock<std::shared_mutex> next_lk(next->m);
+                lk.unlock();
+                f(*next->data);
+                current = next;
+                lk = std::move(next_lk);
+            } }, segment_size);
+    }
+
+    /*
+     * 并行删除，切分方式同 parallel_for_each
+     * 分界点只能由前一段删除（删除要锁住前驱），而且要等以它为起点的段已经离开它。
+     * 前一段走到分界点时后一段还没开始，就把分界点记下来，所有段结束后再统一检查一次
+     */
+    template <typename Predicate>
+    void parallel_remove_if(Predicate p, std::size_t segment_size = 4096)
+    {
+        std::mutex deferred_mtx;
+        std::vector<node_d *> deferred;
+        run_segments([&](node_d *start, node_d *stop)
+                     {
+            pin_guard start_pin(start->data ? start : nullptr);
+            pin_guard stop_pin(stop);
+            node_d *current = start;
+            std::unique_lock<std::shared_mutex> lk(current->m);
+            start_pin.release();
+            while (node_d *const next = current->next.get())
+            {
+                std::unique_lock<std::shared_mutex> next_lk(next->m);
+                // 持有 next 的锁时只剩本段的一次钉住，说明后一段已经离开它，也没有别的批量操作用它做边界
+                bool const removable = next->pins.load(std::memory_order_acquire) == (next == stop ? 1 : 0);
+                bool const matched = p(*next->data);
+                if (matched && removable)
+                {
+                    // 分界点要先解除本段的钉住再摘下释放，否则 pin_guard 析构时会写已经释放的节点
+                    if (next == stop)
+                    {
+                        stop_pin.release();
+                    }
+                    std::unique_ptr<node_d> old_next = unlink_next(current);
+                    next_lk.unlock();
+                }
+                else
+                {
+                    if (matched)
+                    {
+                        std::lock_guard<std::mutex> deferred_lk(deferred_mtx);
+                        deferred.push_back(next);
+                    }
+                    if (next == stop)
+                    {
+                        stop_pin.release();
+                    }
+                    lk.unlock();
+                    current = next;
+                    lk = std::move(next_lk);
+                }
+                if (next == stop)
+                {
+                    break;
+                }
+            } }, segment_size);
+
+        if (!deferred.empty())
+        {
+            // 记下的节点此后可能已被删除，地址可能被新节点复用，所以按地址匹配后仍要重新判断
+            std::sort(deferred.begin(), deferred.end());
+            unlink_if([&](node_d &n)
+                      { return std::binary_search(deferred.begin(), deferred.end(), &n) && p(*n.data); });
+        }
+    }
+
+private:
+    // 段任务持有的一次钉住，正常走到时提前解除，p 或 f 抛出异常时在析构中解除，
+    // 否则钉住的节点永远删不掉，remove_if 和析构会一直等下去
+    class pin_guard
+    {
+    public:
+        explicit pin_guard(node_d *node_) : node(node_)
+        {
+        }
+        pin_guard(pin_guard const &) = delete;
+        pin_guard &operator=(pin_guard const &) = delete;
+        ~pin_guard()
+        {
+            release();
+        }
+        void release()
+        {
+            if (node != nullptr)
+            {
+                node->pins.fetch_sub(1, std::memory_order_release);
+                node = nullptr;
+            }
+        }
+
+    private:
+        node_d *node;
+    };
+
+    // 摘下 current 的下一个节点，调用方持有 current 和下一个节点的锁，先解锁再释放返回的节点
+    std::unique_ptr<node_d> unlink_next(node_d *current)
+    {
+        std::unique_ptr<node_d> old_next = std::move(current->next);
+        current->next = std::move(old_next->next);
+        // 判断删除的是否为最后一个节点
+        if (current->next == nullptr)
+        {
+            std::lock_guard<std::mutex> last_lk(last_ptr_mtx);
+            last_node_ptr = current;
+        }
+        return old_next;
+    }
+
+    template <typename NodePredicate>
+    void unlink_if(NodePredicate p)
+    {
+        node_d *current = &head;
+        std::unique_lock<std::shared_mutex> lk(head.m);
+        while (node_d *const next = current->next.get())
+        {
+            std::unique_lock<std::shared_mutex> next_lk(next->m);
+            if (p(*next))
+            {
+                if (next->pins.load(std::memory_order_acquire) != 0)
+                {
+                    // 节点是并行批量操作的分段边界，等它处理完再从头删除
+                    next_lk.unlock();
+                    lk.unlock();
+                    std::this_thread::yield();
+                    current = &head;
+                    lk = std::unique_lock<std::shared_mutex>(head.m);
+                    continue;
+                }
+                std::unique_ptr<node_d> old_next = unlink_next(current);
+                next_lk.unlock();
+            }
+            else
+            {
+                lk.unlock();
+                current = next;
+                lk = std::move(next_lk);
+            }
+        }
+    }
+
+    // 切分链表并把每段 [start, stop) 交给线程池执行 segment(start, stop)，stop 为空表示直到链表末尾
+    template <typename Segment>
+    void run_segments(Segment segment, std::size_t segment_size)
+    {
+        if (segment_size == 0)
+        {
+            segment_size = 1;
+        }
+        std::vector<node_d *> bounds{&head};
+        std::vector<std::future<void>> futures;
+        std::size_t submitted = 0;
+        std::exception_ptr error;
+        auto submit = [&](node_d *start, node_d *stop)
+        {
+            std::future<void> fut = ThreadPool::getInstance()->commit([&segment, start, stop]()
+                                                                      { segment(start, stop); });
+            if (fut.valid())
+            {
+                futures.push_back(std::move(fut));
+                return;
+            }
+            // 线程池已经停止，在当前线程执行；抛出异常也要继续切分，后面的分界点要交给各自的段解除钉住
+            try
+            {
+                segment(start, stop);
+            }
+            catch (...)
+            {
+                if (!error)
+                {
+                    error = std::current_exception();
+                }
+            }
+        };
+
+        node_d *current = &head;
+        std::shared_lock<std::shared_mutex> lk(head.m);
+        std::size_t count = 0;
+        while (node_d *const next = current->next.get())
+        {
+            std::shared_lock<std::shared_mutex> next_lk(next->m);
+            lk.unlock();
+            // 已经钉住的分界点都不再持有锁，可以把它们之前的段投递出去
+            for (; submitted + 1 < bounds.size(); ++submitted)
+            {
+                submit(bounds[submitted], bounds[submitted + 1]);
+            }
+            current = next;
+            lk = std::move(next_lk);
+            if (++count == segment_size)
+            {
+                count = 0;
+                current->pins.fetch_add(2, std::memory_order_relaxed);
+                bounds.push_back(current);
+            }
+        }
+        lk.unlock();
+        for (; submitted + 1 < bounds.size(); ++submitted)
+        {
+            submit(bounds[submitted], bounds[submitted + 1]);
+        }
+        submit(bounds.back(), nullptr);
+
+        // 所有段都结束后才能返回，段任务引用了调用方的函数对象
+        for (auto &fut : futures)
+        {
+            try
+            {
+                fut.get();
+            }
+            catch (...)
+            {
+                if (!error)
+                {
+                    error = std::current_exception();
+                }
+            }
+        }
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
 };
 
 void TestTailPush()
@@ -275,4 +554,124 @@ void MultiThreadPush()
     thread_safe_list.for_each([](const MyClass &mc)
                               { std::cout << "for each print " << mc << std::endl; });
     std::cout << "end for each print...." << std::endl;
-}
\ No newline at end of file
+}
+/* 多个只读遍历并行，同时有写者在尾部插入 */
+void TestSharedTraversal()
+{
+    double_push_list<MyClass> thread_safe_list;
+    for (int i = 0; i < 10000; i++)
+    {
+        thread_safe_list.push_back(MyClass(i));
+    }
+
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; t++)
+    {
+        readers.emplace_back([&]()
+                             {
+            for (int round = 0; round < 10; round++)
+            {
+                long sum = 0;
+                thread_safe_list.for_each_shared([&](const MyClass &mc)
+                                                 { sum += mc.GetData(); });
+                auto find_data = thread_safe_list.find_first_if([](const MyClass &mc)
+                                                                { return mc.GetData() == 9999; });
+                if (!find_data)
+                {
+                    std::cout << "find data failed" << std::endl;
+                }
+            } });
+    }
+
+    std::thread writer([&]()
+                       {
+        for (int i = 10000; i < 20000; i++)
+        {
+            thread_safe_list.push_back(MyClass(i));
+        } });
+
+    for (auto &th : readers)
+    {
+        th.join();
+    }
+    writer.join();
+
+    long sum = 0;
+    thread_safe_list.for_each_shared([&](const MyClass &mc)
+                                     { sum += mc.GetData(); });
+    std::cout << "sum is " << sum << ", expected " << 20000L * 19999 / 2 << std::endl;
+}
+
+/* 并行遍历与并行删除，同时有线程在两端插入 */
+void TestParallelBulk()
+{
+    double_push_list<int> thread_safe_list;
+    for (int i = 0; i < 100000; i++)
+    {
+        thread_safe_list.push_back(i);
+    }
+
+    std::thread writer([&]()
+                       {
+        for (int i = 100000; i < 110000; i++)
+        {
+            thread_safe_list.push_front(i);
+        } });
+    thread_safe_list.parallel_for_each([](int &value)
+                                       { value *= 2; }, 1000);
+    writer.join();
+
+    std::atomic<long> odd{0};
+    thread_safe_list.parallel_for_each([&](int &value)
+                                       { odd += value & 1; });
+    thread_safe_list.parallel_remove_if([](int const &value)
+                                        { return value % 4 == 0; }, 1000);
+
+    long count = 0;
+    long bad = 0;
+    thread_safe_list.for_each_shared([&](int const &value)
+                                     {
+        count++;
+        if (value % 4 == 0)
+        {
+            bad++;
+        } });
+    std::cout << "odd values " << odd << ", left " << count << ", not removed " << bad << std::endl;
+
+    // 回调抛出异常后分界点的钉住全部解除，之后的 remove_if 和析构不会卡住
+    try
+    {
+        thread_safe_list.parallel_for_each([](int &value)
+                                           {
+            if (value % 4 == 2)
+            {
+                throw std::runtime_error("bad value");
+            } }, 1000);
+    }
+    catch (std::exception const &e)
+    {
+        std::cout << "parallel_for_each threw " << e.what() << std::endl;
+    }
+    thread_safe_list.remove_if([](int const &)
+                               { return true; });
+    std::cout << "removed all after exception" << std::endl;
+
+    // 每段只有一两个节点，删除全部元素，分界点全部命中谓词并由前一段删除
+    for (std::size_t segment_size = 1; segment_size <= 2; segment_size++)
+    {
+        for (int i = 0; i < 10000; i++)
+        {
+            thread_safe_list.push_back(i);
+        }
+        thread_safe_list.parallel_remove_if([](int const &)
+                                            { return true; }, segment_size);
+        long left = 0;
+        thread_safe_list.for_each_shared([&](int const &)
+                                         { left++; });
+        std::cout << "segment size " << segment_size << ", left after removing all " << left << std::endl;
+    }
+    // 节点池复用了被删除的分界点，钉住计数不能被错误地减掉，否则这里会卡住
+    thread_safe_list.push_back(1);
+    thread_safe_list.remove_if([](int const &)
+                               { return true; });
+}
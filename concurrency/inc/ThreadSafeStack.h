@@ -1,7 +1,20 @@
+#pragma once
+
 #include <exception>
 #include <mutex>
 #include <stack>
 #include <condition_variable>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <algorithm>
 
 struct empty_stack : std::exception
 {
@@ -148,4 +161,635 @@ public:
         data.pop();
         return res;
     }
-};
\ No newline at end of file
+};
+
+/*
+ * 无锁栈（Treiber 栈），pop 失败时返回 false 而不是抛异常
+ * 1. 栈顶指针与一个 16 位版本号打包在一个 64 位原子变量里，每次修改版本号加一，
+ *    即使栈顶被弹出又压回同一个节点（ABA），compare_exchange 也会因为版本号不同而失败
+ * 2. 弹出的节点不归还给系统，而是放进内部同样带版本号的空闲链表，下次 push 复用，
+ *    所以其他线程读取已弹出节点的 next 时内存仍然有效，节点只在析构时统一释放
+ * 打包依赖用户态指针只使用低 48 位，x86-64 和 aarch64 都满足
+ */
+template <typename T>
+class elimination_backoff_stack;
+
+template <typename T>
+class lock_free_stack
+{
+    static_assert(sizeof(void *) == 8, "lock_free_stack packs a tag into 64-bit pointers");
+    // 消除栈需要单次尝试的 push/pop 来判断竞争
+    friend class elimination_backoff_stack<T>;
+
+private:
+    struct node
+    {
+        std::atomic<node *> next{nullptr};
+        // 值的存储，push 时原地构造，pop 时析构
+        alignas(T) unsigned char storage[sizeof(T)];
+
+        T *value()
+        {
+            return reinterpret_cast<T *>(storage);
+        }
+    };
+
+    // 高 16 位为版本号，低 48 位为指针
+    static constexpr int tag_shift = 48;
+    static constexpr std::uint64_t ptr_mask = (std::uint64_t(1) << tag_shift) - 1;
+
+    static node *get_ptr(std::uint64_t tagged)
+    {
+        return reinterpret_cast<node *>(tagged & ptr_mask);
+    }
+
+    static std::uint64_t make_tagged(node *ptr, std::uint64_t old_tagged)
+    {
+        std::uint64_t const tag = (old_tagged >> tag_shift) + 1;
+        return (tag << tag_shift) | reinterpret_cast<std::uint64_t>(ptr);
+    }
+
+    // 把节点压入 list 指向的链表
+    static void push_node(std::atomic<std::uint64_t> &list, node *n)
+    {
+        std::uint64_t old_head = list.load(std::memory_order_relaxed);
+        do
+        {
+            n->next.store(get_ptr(old_head), std::memory_order_relaxed);
+        } while (!list.compare_exchange_weak(old_head, make_tagged(n, old_head),
+                                             std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    // 从 list 指向的链表弹出节点，链表为空返回 nullptr
+    static node *pop_node(std::atomic<std::uint64_t> &list)
+    {
+        std::uint64_t old_head = list.load(std::memory_order_acquire);
+        for (;;)
+        {
+            node *n = get_ptr(old_head);
+            if (n == nullptr)
+            {
+                return nullptr;
+            }
+            // n 可能已经被其他线程弹出并复用，读到的 next 可能是旧的，但版本号会让下面的 CAS 失败
+            node *next = n->next.load(std::memory_order_relaxed);
+            if (list.compare_exchange_weak(old_head, make_tagged(next, old_head),
+                                           std::memory_order_acquire, std::memory_order_acquire))
+            {
+                return n;
+            }
+        }
+    }
+
+    // 只尝试一次 CAS，失败说明有竞争，返回 false
+    static bool try_push_node_once(std::atomic<std::uint64_t> &list, node *n)
+    {
+        std::uint64_t old_head = list.load(std::memory_order_relaxed);
+        n->next.store(get_ptr(old_head), std::memory_order_relaxed);
+        return list.compare_exchange_strong(old_head, make_tagged(n, old_head),
+                                            std::memory_order_release, std::memory_order_relaxed);
+    }
+
+    enum pop_result
+    {
+        pop_success,
+        pop_empty,
+        pop_contended
+    };
+
+    // 只尝试一次 CAS，区分栈为空和有竞争两种失败
+    static pop_result try_pop_node_once(std::atomic<std::uint64_t> &list, node *&out)
+    {
+        std::uint64_t old_head = list.load(std::memory_order_acquire);
+        node *n = get_ptr(old_head);
+        if (n == nullptr)
+        {
+            return pop_empty;
+        }
+        node *next = n->next.load(std::memory_order_relaxed);
+        if (list.compare_exchange_strong(old_head, make_tagged(next, old_head),
+                                         std::memory_order_acquire, std::memory_order_relaxed))
+        {
+            out = n;
+            return pop_success;
+        }
+        return pop_contended;
+    }
+
+    node *allocate_node()
+    {
+        node *n = pop_node(free_list);
+        if (n == nullptr)
+        {
+            n = new node;
+            assert((reinterpret_cast<std::uint64_t>(n) & ~ptr_mask) == 0);
+        }
+        return n;
+    }
+
+    static void delete_list(std::atomic<std::uint64_t> &list, bool destroy_value)
+    {
+        node *n = get_ptr(list.load(std::memory_order_relaxed));
+        while (n != nullptr)
+        {
+            node *next = n->next.load(std::memory_order_relaxed);
+            if (destroy_value)
+            {
+                n->value()->~T();
+            }
+            delete n;
+            n = next;
+        }
+    }
+
+    std::atomic<std::uint64_t> head{0};
+    std::atomic<std::uint64_t> free_list{0};
+
+public:
+    lock_free_stack() {}
+
+    lock_free_stack(const lock_free_stack &) = delete;
+    lock_free_stack &operator=(const lock_free_stack &) = delete;
+
+    ~lock_free_stack()
+    {
+        delete_list(head, true);
+        delete_list(free_list, false);
+    }
+
+    template <typename... Args>
+    void emplace(Args &&...args)
+    {
+        node *n = allocate_node();
+        try
+        {
+            new (n->storage) T(std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            push_node(free_list, n);
+            throw;
+        }
+        push_node(head, n);
+    }
+
+    void push(T const &value)
+    {
+        emplace(value);
+    }
+
+    void push(T &&value)
+    {
+        emplace(std::move(value));
+    }
+
+    // 栈为空返回 false，不抛异常
+    bool try_pop(T &value)
+    {
+        node *n = pop_node(head);
+        if (n == nullptr)
+        {
+            return false;
+        }
+        value = std::move(*n->value());
+        n->value()->~T();
+        push_node(free_list, n);
+        return true;
+    }
+
+    std::shared_ptr<T> try_pop()
+    {
+        node *n = pop_node(head);
+        if (n == nullptr)
+        {
+            return std::shared_ptr<T>();
+        }
+        std::shared_ptr<T> res(std::make_shared<T>(std::move(*n->value())));
+        n->value()->~T();
+        push_node(free_list, n);
+        return res;
+    }
+
+    bool empty() const
+    {
+        return get_ptr(head.load(std::memory_order_acquire)) == nullptr;
+    }
+};
+
+/* 测试 */
+void TestLockFreeStack()
+{
+    lock_free_stack<int> stack;
+    std::atomic<long> pop_sum{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+    {
+        threads.emplace_back([&, t]()
+                             {
+            for (int i = 1; i <= 10000; i++)
+            {
+                stack.push(t * 10000 + i);
+                int value;
+                // 压入后立即弹出，节点在空闲链表和栈之间反复复用，最容易触发 ABA
+                if (stack.try_pop(value))
+                {
+                    pop_sum += value;
+                }
+            } });
+    }
+    for (auto &th : threads)
+    {
+        th.join();
+    }
+    int value;
+    while (stack.try_pop(value))
+    {
+        pop_sum += value;
+    }
+    // 1 到 40000 的和
+    std::cout << "pop sum is " << pop_sum << ", expected " << 40000L * 40001 / 2 << std::endl;
+}
+
+/*
+ * 消除退避栈：在无锁栈前面加一个消除数组
+ * 高并发时大量线程同时 CAS 栈顶，大部分 CAS 都会失败。一次 push 紧接着一次 pop，栈的状态不变，
+ * 所以 CAS 失败的 push 和 pop 可以在消除数组中直接配对交换值，完全不碰栈顶：
+ * 1. push 在栈顶 CAS 失败后，把自己的报价（值的地址）放进随机一个槽位，自旋等待一段时间
+ * 2. pop 在栈顶 CAS 失败后，去随机一个槽位看看，有报价就用 CAS 把槽位清空来认领，然后取走值
+ * 3. push 等待超时后用 CAS 撤回报价，撤回失败说明已经被认领，等认领者取完值再返回
+ * 消除数组的有效范围自适应：配对成功就扩大让更多线程分散开，超时就缩小提高相遇的概率
+ * 接口与 threadsafe_stack_waitable 相同，可以直接替换
+ */
+void TestEliminationBackoffStack();
+
+template <typename T>
+class elimination_backoff_stack
+{
+    // 测试中直接调用 try_eliminate_push 报价，验证配对和计数
+    friend void TestEliminationBackoffStack();
+
+public:
+    struct stack_stats
+    {
+        std::uint64_t cas_failures = 0; // 栈顶 CAS 失败次数
+        std::uint64_t eliminations = 0; // 在消除数组中配对成功的次数
+        std::uint64_t timeouts = 0;     // push 报价超时撤回的次数
+    };
+
+private:
+    typedef lock_free_stack<T> stack_type;
+    typedef typename stack_type::node node;
+
+    // push 放在槽位中的报价，生命周期在 push 的栈帧内
+    struct offer
+    {
+        T *value;
+        std::atomic<bool> taken{false};
+    };
+
+    struct alignas(64) slot_type
+    {
+        std::atomic<offer *> current{nullptr};
+    };
+
+    struct alignas(64) counter_type
+    {
+        std::atomic<std::uint64_t> value{0};
+    };
+
+    static constexpr unsigned slot_count = 16;
+    static constexpr unsigned min_spin = 64;
+    static constexpr unsigned max_spin = 4096;
+
+    static unsigned random_below(unsigned bound)
+    {
+        thread_local std::minstd_rand engine(std::random_device{}());
+        return static_cast<unsigned>(engine() % bound);
+    }
+
+    slot_type &random_slot()
+    {
+        return slots[random_below(range.load(std::memory_order_relaxed))];
+    }
+
+    void grow_range()
+    {
+        unsigned r = range.load(std::memory_order_relaxed);
+        if (r < slot_count)
+        {
+            range.compare_exchange_weak(r, r + 1, std::memory_order_relaxed);
+        }
+    }
+
+    void shrink_range()
+    {
+        unsigned r = range.load(std::memory_order_relaxed);
+        if (r > 1)
+        {
+            range.compare_exchange_weak(r, r - 1, std::memory_order_relaxed);
+        }
+    }
+
+    // push 在消除数组中报价，被 pop 认领返回 true
+    bool try_eliminate_push(T &value, unsigned spin)
+    {
+        offer my_offer;
+        my_offer.value = &value;
+        slot_type &slot = random_slot();
+        offer *expected = nullptr;
+        if (!slot.current.compare_exchange_strong(expected, &my_offer, std::memory_order_release, std::memory_order_relaxed))
+        {
+            // 槽位被别的 push 占了，说明竞争激烈，扩大范围
+            grow_range();
+            return false;
+        }
+        for (unsigned i = 0; i < spin; ++i)
+        {
+            if (slot.current.load(std::memory_order_relaxed) != &my_offer)
+            {
+                break;
+            }
+            // 线程数多于核数时让出时间片，给 pop 线程相遇的机会
+            if ((i & 63) == 63)
+            {
+                std::this_thread::yield();
+            }
+        }
+        expected = &my_offer;
+        if (slot.current.compare_exchange_strong(expected, nullptr, std::memory_order_relaxed))
+        {
+            // 撤回成功，没人来取
+            timeouts.value.fetch_add(1, std::memory_order_relaxed);
+            shrink_range();
+            return false;
+        }
+        // 已被认领，等 pop 把值取走，my_offer 和 value 才能离开作用域
+        while (!my_offer.taken.load(std::memory_order_acquire))
+        {
+            std::this_thread::yield();
+        }
+        eliminations.value.fetch_add(1, std::memory_order_relaxed);
+        grow_range();
+        return true;
+    }
+
+    // pop 到消除数组中认领一个 push 的报价
+    bool try_eliminate_pop(T &value)
+    {
+        slot_type &slot = random_slot();
+        offer *current = slot.current.load(std::memory_order_acquire);
+        if (current == nullptr)
+        {
+            return false;
+        }
+        // 认领前不解引用 current，所以即使槽位被换成了新的报价也没关系
+        if (!slot.current.compare_exchange_strong(current, nullptr, std::memory_order_acquire, std::memory_order_relaxed))
+        {
+            return false;
+        }
+        value = std::move(*current->value);
+        current->taken.store(true, std::memory_order_release);
+        return true;
+    }
+
+    void notify_waiters()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) > 0)
+        {
+            std::lock_guard<std::mutex> lock(wait_mutex);
+            wait_cv.notify_one();
+        }
+    }
+
+    stack_type stack;
+    slot_type slots[slot_count];
+    std::atomic<unsigned> range{1};
+    counter_type cas_failures;
+    counter_type eliminations;
+    counter_type timeouts;
+    // 只有 wait_and_pop 阻塞时才使用
+    std::atomic<unsigned> waiters{0};
+    std::mutex wait_mutex;
+    std::condition_variable wait_cv;
+
+public:
+    elimination_backoff_stack() {}
+
+    elimination_backoff_stack(const elimination_backoff_stack &) = delete;
+    elimination_backoff_stack &operator=(const elimination_backoff_stack &) = delete;
+
+    void push(T new_value)
+    {
+        unsigned spin = min_spin;
+        node *n = stack.allocate_node();
+        new (n->storage) T(std::move(new_value));
+        while (!stack_type::try_push_node_once(stack.head, n))
+        {
+            cas_failures.value.fetch_add(1, std::memory_order_relaxed);
+            // 报价的是节点中的值，被认领时 pop 直接从节点取走，节点归还空闲链表
+            if (try_eliminate_push(*n->value(), spin))
+            {
+                n->value()->~T();
+                stack_type::push_node(stack.free_list, n);
+                return;
+            }
+            spin = spin < max_spin ? spin * 2 : max_spin;
+        }
+        notify_waiters();
+    }
+
+    bool try_pop(T &value)
+    {
+        for (;;)
+        {
+            node *n = nullptr;
+            typename stack_type::pop_result res = stack_type::try_pop_node_once(stack.head, n);
+            if (res == stack_type::pop_success)
+            {
+                value = std::move(*n->value());
+                n->value()->~T();
+                stack_type::push_node(stack.free_list, n);
+                return true;
+            }
+            // 配对成功由 push 一侧计数，这里不再重复计数
+            if (try_eliminate_pop(value))
+            {
+                return true;
+            }
+            if (res == stack_type::pop_empty)
+            {
+                return false;
+            }
+            cas_failures.value.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    std::shared_ptr<T> try_pop()
+    {
+        T value;
+        if (!try_pop(value))
+        {
+            return std::shared_ptr<T>();
+        }
+        return std::make_shared<T>(std::move(value));
+    }
+
+    void wait_and_pop(T &value)
+    {
+        // 先自旋几次，大多数情况下很快就有数据
+        for (unsigned i = 0; i < min_spin; ++i)
+        {
+            if (try_pop(value))
+            {
+                return;
+            }
+        }
+        std::unique_lock<std::mutex> lock(wait_mutex);
+        waiters.fetch_add(1, std::memory_order_seq_cst);
+        while (!try_pop(value))
+        {
+            wait_cv.wait(lock, [this]()
+                         { return !stack.empty(); });
+        }
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    std::shared_ptr<T> wait_and_pop()
+    {
+        T value;
+        wait_and_pop(value);
+        return std::make_shared<T>(std::move(value));
+    }
+
+    bool empty() const
+    {
+        return stack.empty();
+    }
+
+    stack_stats stats() const
+    {
+        stack_stats res;
+        res.cas_failures = cas_failures.value.load(std::memory_order_relaxed);
+        res.eliminations = eliminations.value.load(std::memory_order_relaxed);
+        res.timeouts = timeouts.value.load(std::memory_order_relaxed);
+        return res;
+    }
+};
+
+void TestEliminationBackoffStack()
+{
+    elimination_backoff_stack<int> stack;
+    std::atomic<long> pop_sum{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; t++)
+    {
+        threads.emplace_back([&, t]()
+                             {
+            for (int i = 1; i <= 10000; i++)
+            {
+                stack.push(t * 10000 + i);
+                int value;
+                if (stack.try_pop(value))
+                {
+                    pop_sum += value;
+                }
+            } });
+    }
+    for (auto &th : threads)
+    {
+        th.join();
+    }
+    int value;
+    while (stack.try_pop(value))
+    {
+        pop_sum += value;
+    }
+    auto st = stack.stats();
+    std::cout << "pop sum is " << pop_sum << ", expected " << 80000L * 80001 / 2 << std::endl;
+    std::cout << "cas failures " << st.cas_failures << " eliminations " << st.eliminations
+              << " timeouts " << st.timeouts << std::endl;
+
+    // 竞争场景：生产者和消费者分开，线程数是核数的两倍，栈顶 CAS 失败的 push 和 pop 在消除数组中配对。
+    // 每次配对只计一次，所以配对次数不会超过 pop 的次数
+    {
+        unsigned const workers = 2 * std::max(2u, std::thread::hardware_concurrency());
+        int const per_thread = 20000;
+        long const total = static_cast<long>(workers) * per_thread;
+        elimination_backoff_stack<int> contended;
+        std::atomic<long> popped_sum{0};
+        std::atomic<long> popped{0};
+        std::vector<std::thread> pairs;
+        for (unsigned t = 0; t < workers; t++)
+        {
+            pairs.emplace_back([&]()
+                               {
+                for (int i = 1; i <= per_thread; i++)
+                {
+                    contended.push(i);
+                } });
+            pairs.emplace_back([&]()
+                               {
+                int value;
+                while (popped.load(std::memory_order_relaxed) < total)
+                {
+                    if (contended.try_pop(value))
+                    {
+                        popped_sum += value;
+                        popped++;
+                    }
+                } });
+        }
+        for (auto &th : pairs)
+        {
+            th.join();
+        }
+        st = contended.stats();
+        long const expected = static_cast<long>(workers) * per_thread * (per_thread + 1) / 2;
+        std::cout << "contended pop sum is " << popped_sum << ", expected " << expected
+                  << ", cas failures " << st.cas_failures << " eliminations " << st.eliminations
+                  << " timeouts " << st.timeouts << std::endl;
+        assert(popped_sum == expected);
+        assert(popped == total);
+        assert(st.eliminations <= static_cast<std::uint64_t>(total));
+    }
+
+    // 直接在消除数组中配对：push 报价后等待，栈是空的，try_pop 在消除数组中认领报价，每次配对 eliminations 只加一
+    {
+        elimination_backoff_stack<int> paired;
+        int const rounds = 100;
+        long sum = 0;
+        for (int round = 1; round <= rounds; round++)
+        {
+            int offered = round;
+            std::thread pusher([&]()
+                               {
+                // 报价超时撤回就再报一次，直到被认领
+                while (!paired.try_eliminate_push(offered, paired.max_spin))
+                {
+                } });
+            int value = 0;
+            while (!paired.try_pop(value))
+            {
+                std::this_thread::yield();
+            }
+            pusher.join();
+            sum += value;
+        }
+        st = paired.stats();
+        std::cout << "paired sum is " << sum << ", expected " << rounds * (rounds + 1) / 2
+                  << ", eliminations " << st.eliminations << ", expected " << rounds << std::endl;
+        assert(sum == rounds * (rounds + 1) / 2);
+        assert(st.eliminations == static_cast<std::uint64_t>(rounds));
+        assert(paired.empty());
+    }
+
+    // 阻塞弹出
+    std::thread consumer([&]()
+                         {
+        auto data = stack.wait_and_pop();
+        std::cout << "wait and pop data is " << *data << std::endl; });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    stack.push(42);
+    consumer.join();
+}
@@ -0,0 +1,402 @@
+#pragma once
+
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <random>
+#include <cstdint>
+#include <algorithm>
+#include "Singleton.h"
+#include "ThreadPool.h"
+#include "CSP.h"
+
+/*
+ * 分层时间轮定时器服务
+ *   auto t = timer_service::getInstance()->schedule_after(std::chrono::milliseconds(100), [] { ... });
+ *   timer_service::getInstance()->cancel(t);
+ * 1. 时间按 tick（默认 1ms）离散化，4 层时间轮每层 256 个槽，第 l 层一个槽覆盖 256^l 个 tick，
+ *    一共覆盖 2^32 个 tick（1ms 时约 49 天），更远的定时器先放在最高层，转到时再重新放置
+ * 2. 插入按到期时间与当前时间的差选层、按到期时间的对应位选槽，取消直接从槽的链表中摘下，都是 O(1)
+ * 3. 第 0 层转满一圈时把上一层当前槽里的定时器重新放置（cascade），越近的定时器落到越低的层
+ * 4. 驱动线程按 tick 推进时间轮，第 0 层为空时直接跳到下一次 cascade，没有定时器时一直睡眠
+ * 到期的回调投递到 ThreadPool 执行，线程池停止后在驱动线程上执行；回调不能假设在哪个线程上运行。
+ * 周期定时器按上一次的到期时间累加周期，不会随回调的耗时漂移；已经投递的回调在取消之后仍可能执行一次
+ */
+class timer_service : public Singleton<timer_service>
+{
+    friend class Singleton<timer_service>;
+
+    static constexpr unsigned slot_bits = 8;
+    static constexpr unsigned slots = 1u << slot_bits;
+    static constexpr unsigned levels = 4;
+
+    struct timer_node;
+    using slot_list = std::list<std::shared_ptr<timer_node>>;
+
+    struct timer_node
+    {
+        std::function<void()> callback;
+        std::uint64_t expire = 0; // 到期的 tick
+        std::uint64_t period = 0; // 周期的 tick 数，0 表示一次性
+        bool linked = false;      // 是否挂在时间轮上，以下三个成员只在 linked 时有效
+        unsigned level = 0;
+        unsigned index = 0;
+        slot_list::iterator pos;
+    };
+
+public:
+    using clock = std::chrono::steady_clock;
+
+    // 定时器句柄，只用于取消；定时器触发或取消之后句柄自然失效
+    class timer_handle
+    {
+    public:
+        timer_handle() = default;
+
+    private:
+        friend class timer_service;
+        explicit timer_handle(std::weak_ptr<timer_node> node_) : node(std::move(node_)) {}
+        std::weak_ptr<timer_node> node;
+    };
+
+    timer_service(timer_service const &) = delete;
+    timer_service &operator=(timer_service const &) = delete;
+
+    ~timer_service()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cond.notify_one();
+        if (driver.joinable())
+        {
+            driver.join();
+        }
+    }
+
+    timer_handle schedule_at(clock::time_point deadline, std::function<void()> callback)
+    {
+        return add(to_tick(deadline), 0, std::move(callback));
+    }
+
+    template <typename Rep, typename Period>
+    timer_handle schedule_after(std::chrono::duration<Rep, Period> const &delay, std::function<void()> callback)
+    {
+        return schedule_at(clock::now() + std::chrono::duration_cast<clock::duration>(delay), std::move(callback));
+    }
+
+    // 每隔 period 执行一次，第一次在 period 之后
+    template <typename Rep, typename Period>
+    timer_handle schedule_every(std::chrono::duration<Rep, Period> const &period, std::function<void()> callback)
+    {
+        std::uint64_t const ticks = std::max<std::uint64_t>(1, std::chrono::duration_cast<clock::duration>(period) / tick);
+        return add(to_tick(clock::now()) + ticks, ticks, std::move(callback));
+    }
+
+    // 还没触发的定时器被取消时返回 true
+    bool cancel(timer_handle const &handle)
+    {
+        std::shared_ptr<timer_node> node = handle.node.lock();
+        if (!node)
+        {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!node->linked)
+        {
+            return false;
+        }
+        unlink(*node);
+        return true;
+    }
+
+    /*
+     * 类似 Go 的 time.After：delay 之后向返回的通道发送到期时间，可以作为 channel_select 的一个分支
+     * 只想给单个 receive 加超时时用 Channel::receive_for 更省，它不需要定时器
+     */
+    template <typename Rep, typename Period>
+    std::shared_ptr<Channel<clock::time_point>> after(std::chrono::duration<Rep, Period> const &delay)
+    {
+        std::shared_ptr<Channel<clock::time_point>> ch = std::make_shared<Channel<clock::time_point>>(1);
+        schedule_after(delay, [ch]()
+                       {
+            ch->send(clock::now());
+            ch->close(); });
+        return ch;
+    }
+
+    std::size_t pending() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return pending_count;
+    }
+
+    clock::duration resolution() const
+    {
+        return tick;
+    }
+
+private:
+    explicit timer_service(clock::duration tick_ = std::chrono::milliseconds(1))
+        : tick(tick_), start(clock::now()), pool(ThreadPool::getInstance()) // 持有线程池，保证它比定时器服务晚析构
+    {
+        driver = std::thread([this]()
+                             { run(); });
+    }
+
+    // 向上取整，定时器不会早于 deadline 触发
+    std::uint64_t to_tick(clock::time_point t) const
+    {
+        if (t <= start)
+        {
+            return 0;
+        }
+        return static_cast<std::uint64_t>((t - start + tick - clock::duration(1)) / tick);
+    }
+
+    // 向下取整，已经完整经过的 tick 数
+    std::uint64_t elapsed_ticks() const
+    {
+        return static_cast<std::uint64_t>((clock::now() - start) / tick);
+    }
+
+    timer_handle add(std::uint64_t expire, std::uint64_t period, std::function<void()> callback)
+    {
+        std::shared_ptr<timer_node> node = std::make_shared<timer_node>();
+        node->callback = std::move(callback);
+        node->period = period;
+        bool wake = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            node->expire = std::max(expire, current + 1);
+            link(node);
+            // 驱动线程可能按第 0 层为空算好了较长的睡眠时间
+            wake = node->level == 0 || pending_count == 1;
+        }
+        if (wake)
+        {
+            cond.notify_one();
+        }
+        return timer_handle(node);
+    }
+
+    // 调用方持有 mutex。按到期时间与当前时间的差选层，超出范围的放在最高层
+    void link(std::shared_ptr<timer_node> const &node)
+    {
+        std::uint64_t const delta = node->expire - current;
+        unsigned level = 0;
+        while (level + 1 < levels && delta >= (std::uint64_t(1) << (slot_bits * (level + 1))))
+        {
+            ++level;
+        }
+        std::uint64_t const span = std::uint64_t(1) << (slot_bits * levels);
+        std::uint64_t const placed = delta < span ? node->expire : current + span - 1;
+        unsigned const index = static_cast<unsigned>((placed >> (slot_bits * level)) & (slots - 1));
+        slot_list &slot = wheel[level][index];
+        node->pos = slot.insert(slot.end(), node);
+        node->level = level;
+        node->index = index;
+        node->linked = true;
+        ++level_count[level];
+        ++pending_count;
+    }
+
+    // 调用方持有 mutex。调用方持有 node 的 shared_ptr，从链表中摘下时不会被释放
+    void unlink(timer_node &node)
+    {
+        wheel[node.level][node.index].erase(node.pos);
+        node.linked = false;
+        --level_count[node.level];
+        --pending_count;
+    }
+
+    void run()
+    {
+        std::vector<std::shared_ptr<timer_node>> expired;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stop)
+        {
+            advance(elapsed_ticks(), expired);
+            if (!expired.empty())
+            {
+                lock.unlock();
+                dispatch(expired);
+                expired.clear();
+                lock.lock();
+                continue;
+            }
+            if (pending_count == 0)
+            {
+                cond.wait(lock);
+                continue;
+            }
+            // 第 0 层有定时器时下一个 tick 醒来，否则睡到下一次 cascade
+            std::uint64_t const next = level_count[0] != 0 ? current + 1 : (current | (slots - 1)) + 1;
+            cond.wait_until(lock, start + tick * static_cast<clock::rep>(next));
+        }
+    }
+
+    // 调用方持有 mutex。推进到 target，把到期的定时器放进 expired
+    void advance(std::uint64_t target, std::vector<std::shared_ptr<timer_node>> &expired)
+    {
+        while (current < target)
+        {
+            if (level_count[0] == 0)
+            {
+                // 第 0 层为空，中间的 tick 都不会有定时器到期，直接跳到下一次 cascade 之前
+                std::uint64_t const boundary = current | (slots - 1);
+                if (boundary >= target)
+                {
+                    current = target;
+                    break;
+                }
+                current = boundary;
+            }
+            step(expired);
+        }
+    }
+
+    void step(std::vector<std::shared_ptr<timer_node>> &expired)
+    {
+        ++current;
+        // 第 0 层转满一圈，依次把上层当前槽里的定时器重新放置
+        for (unsigned level = 1; level < levels; ++level)
+        {
+            if ((current & ((std::uint64_t(1) << (slot_bits * level)) - 1)) != 0)
+            {
+                break;
+            }
+            unsigned const index = static_cast<unsigned>((current >> (slot_bits * level)) & (slots - 1));
+            slot_list pending_slot;
+            pending_slot.swap(wheel[level][index]);
+            for (std::shared_ptr<timer_node> &node : pending_slot)
+            {
+                node->linked = false;
+                --level_count[level];
+                --pending_count;
+                link(node);
+            }
+        }
+        unsigned const index = static_cast<unsigned>(current & (slots - 1));
+        slot_list due;
+        due.swap(wheel[0][index]);
+        for (std::shared_ptr<timer_node> &node : due)
+        {
+            node->linked = false;
+            --level_count[0];
+            --pending_count;
+            if (node->expire > current)
+            {
+                // 从最高层放下来但还没到期的远期定时器
+                link(node);
+                continue;
+            }
+            expired.push_back(node);
+            if (node->period != 0)
+            {
+                node->expire = std::max(node->expire + node->period, current + 1);
+                link(node);
+            }
+        }
+    }
+
+    // 同一批到期的回调按 dispatch_batch 个一组投递，大量定时器同时到期时不会为每个回调都提交一次任务
+    void dispatch(std::vector<std::shared_ptr<timer_node>> &expired)
+    {
+        for (std::size_t first = 0; first < expired.size(); first += dispatch_batch)
+        {
+            std::size_t const last = std::min(expired.size(), first + dispatch_batch);
+            std::shared_ptr<std::vector<std::shared_ptr<timer_node>>> batch =
+                std::make_shared<std::vector<std::shared_ptr<timer_node>>>(expired.begin() + first, expired.begin() + last);
+            auto run_batch = [batch]()
+            {
+                for (std::shared_ptr<timer_node> const &node : *batch)
+                {
+                    node->callback();
+                }
+            };
+            std::future<void> fut = pool->commit(run_batch);
+            if (!fut.valid())
+            {
+                run_batch();
+            }
+        }
+    }
+
+    static constexpr std::size_t dispatch_batch = 64;
+
+    clock::duration const tick;
+    clock::time_point const start;
+    std::shared_ptr<ThreadPool> pool;
+
+    mutable std::mutex mutex;
+    std::condition_variable cond;
+    slot_list wheel[levels][slots];
+    std::size_t level_count[levels] = {};
+    std::size_t pending_count = 0;
+    std::uint64_t current = 0; // 已经处理完的 tick
+    bool stop = false;
+    std::thread driver;
+};
+
+/* 测试：大量一次性定时器中取消一半，其余都按时触发；周期定时器；after 通道作为 select 的超时分支 */
+void TestTimerWheel()
+{
+    std::shared_ptr<timer_service> timers = timer_service::getInstance();
+    int const count = 200000;
+    // 回调可能在测试返回之后才在线程池上运行（已经分派的回调 cancel 不掉），计数器由回调共享持有
+    std::shared_ptr<std::atomic<int>> fired = std::make_shared<std::atomic<int>>(0);
+    std::shared_ptr<std::atomic<long>> max_late_us = std::make_shared<std::atomic<long>>(0);
+    std::vector<timer_service::timer_handle> handles;
+    handles.reserve(count);
+    std::minstd_rand engine(42);
+    for (int i = 0; i < count; i++)
+    {
+        auto const deadline = timer_service::clock::now() + std::chrono::milliseconds(200 + engine() % 300);
+        handles.push_back(timers->schedule_at(deadline, [fired, max_late_us, deadline]()
+                                              {
+            long const late = static_cast<long>(std::chrono::duration_cast<std::chrono::microseconds>(
+                timer_service::clock::now() - deadline).count());
+            long seen = max_late_us->load();
+            while (late > seen && !max_late_us->compare_exchange_weak(seen, late))
+            {
+            }
+            ++*fired; }));
+    }
+    int cancelled = 0;
+    for (int i = 0; i < count; i += 2)
+    {
+        cancelled += timers->cancel(handles[i]) ? 1 : 0;
+    }
+
+    std::shared_ptr<std::atomic<int>> ticks = std::make_shared<std::atomic<int>>(0);
+    timer_service::timer_handle periodic = timers->schedule_every(std::chrono::milliseconds(20), [ticks]()
+                                                                  { ++*ticks; });
+
+    // 数据通道上等不到数据，after 分支先就绪
+    Channel<int> data;
+    int item = 0;
+    std::shared_ptr<Channel<timer_service::clock::time_point>> timeout = timers->after(std::chrono::milliseconds(50));
+    timer_service::clock::time_point fired_at;
+    channel_select sel;
+    sel.recv(data, item).recv(*timeout, fired_at);
+    int const branch = sel.wait();
+    int value = 0;
+    channel_status const status = data.receive_for(value, std::chrono::milliseconds(10));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(600));
+    timers->cancel(periodic);
+    std::cout << "fired " << *fired << ", cancelled " << cancelled << ", expected fired " << count - cancelled
+              << ", max lateness " << *max_late_us << "us" << std::endl;
+    std::cout << "periodic ticks " << *ticks << " in ~660ms, select branch " << branch
+              << ", receive_for timeout " << (status == channel_status::timeout) << std::endl;
+}